@@ -0,0 +1,393 @@
+(function(){
+  "use strict";
+
+  // Throughput benchmarks for the engines and options, against
+  // fs.copyFile as the baseline.  Results go to stdout as JSON:
+  //
+  //   npm run bench -- --size 1024 --files 2000 --cross /mnt/other
+  //
+  // --dir      where the corpus and the copies go (default: the tmpdir)
+  // --cross    a directory on another device, for the cross-device cases
+  // --size     MB in the sequential and sparse files (default 1024)
+  // --files    4 KB files in the small-file corpus (default 2000)
+  // --runs     runs per case, the median is reported (default 3)
+  // --filter   only run the cases whose name contains this
+  //
+  // The page cache is not dropped between runs, so sources are read
+  // warm; cacheMode "direct" is the case to look at for cold numbers.
+
+  var fs = require('fs');
+  var os = require('os');
+  var path = require('path');
+  var nativefs = require('../nativefs');
+
+  var MB = 1024 * 1024;
+
+  function parse(argv) {
+    var options = {
+      dir: path.join(os.tmpdir(), 'nativefs-bench'),
+      cross: null,
+      size: 1024,
+      files: 2000,
+      runs: 3,
+      filter: ''
+    };
+    for (var i = 0; i < argv.length; i += 2) {
+      var name = argv[i].replace(/^--/, '');
+      if (!(name in options) || i + 1 >= argv.length) {
+        throw new Error('unknown or incomplete argument ' + argv[i]);
+      }
+      options[name] = typeof options[name] === 'number' ? Number(argv[i + 1]) : argv[i + 1];
+    }
+    return options;
+  }
+
+  // Time the event loop spends blocked while a case runs.  Every copy
+  // is supposed to happen off the loop, so this should stay near the
+  // timer's own resolution.
+  function loopMonitor() {
+    var perf_hooks = require('perf_hooks');
+    if (perf_hooks.monitorEventLoopDelay) {
+      var histogram = perf_hooks.monitorEventLoopDelay({ resolution: 10 });
+      histogram.enable();
+      return function() {
+        histogram.disable();
+        // a run shorter than the resolution has no samples
+        return { maxMs: histogram.max / 1e6, meanMs: (histogram.mean || 0) / 1e6 };
+      };
+    }
+
+    // older nodes: how late a 10 ms timer fires
+    var max = 0, total = 0, count = 0, last = process.hrtime();
+    var timer = setInterval(function() {
+      var elapsed = process.hrtime(last);
+      var late = Math.max(0, elapsed[0] * 1e3 + elapsed[1] / 1e6 - 10);
+      max = Math.max(max, late);
+      total += late;
+      count++;
+      last = process.hrtime();
+    }, 10);
+    return function() {
+      clearInterval(timer);
+      return { maxMs: max, meanMs: count ? total / count : 0 };
+    };
+  }
+
+  // Syscall counts aren't available from node, so the closest thing
+  // is reported: filesystem reads and writes, and context switches.
+  function resources() {
+    if (!process.resourceUsage) return null;
+    var usage = process.resourceUsage();
+    return {
+      fsRead: usage.fsRead,
+      fsWrite: usage.fsWrite,
+      voluntaryContextSwitches: usage.voluntaryContextSwitches,
+      involuntaryContextSwitches: usage.involuntaryContextSwitches
+    };
+  }
+
+  function difference(after, before) {
+    if (after === null || before === null) return null;
+    var result = {};
+    Object.keys(after).forEach(function(key) { result[key] = after[key] - before[key]; });
+    return result;
+  }
+
+  function percentile(sorted, p) {
+    if (sorted.length === 0) return null;
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+  }
+
+  function median(values) {
+    var sorted = values.slice().sort(function(a, b) { return a - b; });
+    return sorted[Math.floor(sorted.length / 2)];
+  }
+
+  function now() {
+    var time = process.hrtime();
+    return time[0] * 1e3 + time[1] / 1e6;
+  }
+
+  function remove(target) {
+    if (!fs.existsSync(target)) return;
+    if (fs.statSync(target).isDirectory()) {
+      fs.readdirSync(target).forEach(function(name) { remove(path.join(target, name)); });
+      fs.rmdirSync(target);
+    }
+    else {
+      fs.unlinkSync(target);
+    }
+  }
+
+  // Random data, so nothing along the way can compress or dedup it
+  function writeRandom(file, bytes) {
+    var fd = fs.openSync(file, 'w');
+    var chunk = require('crypto').randomBytes(Math.min(bytes, MB));
+    for (var written = 0; written < bytes; written += chunk.length) {
+      fs.writeSync(fd, chunk, 0, Math.min(chunk.length, bytes - written));
+    }
+    fs.closeSync(fd);
+  }
+
+  // One MB of data every 64 MB, the rest holes
+  function writeSparse(file, bytes) {
+    var fd = fs.openSync(file, 'w');
+    var chunk = require('crypto').randomBytes(MB);
+    for (var position = 0; position < bytes; position += 64 * MB) {
+      fs.writeSync(fd, chunk, 0, Math.min(MB, bytes - position), position);
+    }
+    fs.ftruncateSync(fd, bytes);
+    fs.closeSync(fd);
+  }
+
+  function corpus(options) {
+    var dir = path.join(options.dir, 'corpus');
+    var bytes = options.size * MB;
+
+    if (!fs.existsSync(dir)) fs.mkdirSync(dir);
+
+    var sequential = path.join(dir, 'sequential.bin');
+    if (!fs.existsSync(sequential) || fs.statSync(sequential).size !== bytes) {
+      writeRandom(sequential, bytes);
+    }
+
+    var sparse = path.join(dir, 'sparse.bin');
+    if (!fs.existsSync(sparse) || fs.statSync(sparse).size !== bytes) {
+      writeSparse(sparse, bytes);
+    }
+
+    var small = path.join(dir, 'small');
+    if (!fs.existsSync(small) || fs.readdirSync(small).length !== options.files) {
+      remove(small);
+      fs.mkdirSync(small);
+      var data = require('crypto').randomBytes(4096);
+      for (var i = 0; i < options.files; i++) {
+        fs.writeFileSync(path.join(small, 'file' + i), data);
+      }
+    }
+
+    return { sequential: sequential, sparse: sparse, small: small, bytes: bytes };
+  }
+
+  // Up to limit copies at once, each timed on its own, which gives
+  // the per-file latencies a batch doesn't expose
+  function copyEach(pairs, limit, copy) {
+    return new Promise(function(resolve, reject) {
+      var latencies = [];
+      var next = 0, running = 0, failed = false;
+
+      function start() {
+        if (failed) return;
+        if (next === pairs.length && running === 0) return resolve(latencies);
+
+        while (running < limit && next < pairs.length) {
+          var pair = pairs[next++];
+          var began = now();
+          running++;
+          copy(pair.src, pair.dst).then(function(began) {
+            return function() {
+              latencies.push(now() - began);
+              running--;
+              start();
+            };
+          }(began), function(err) {
+            failed = true;
+            reject(err);
+          });
+        }
+      }
+      start();
+    });
+  }
+
+  function copyFile(src, dst) {
+    return new Promise(function(resolve, reject) {
+      fs.copyFile(src, dst, function(err) { err ? reject(err) : resolve(); });
+    });
+  }
+
+  // A case is a name, the bytes and files it moves, and a run function
+  // returning a promise for { engine, latencies } (both optional).
+  // The destination is removed after every run.
+  function cases(files, options) {
+    var list = [];
+    var out = path.join(options.dir, 'out');
+    var destinations = [{ name: 'same-device', dir: out }];
+    if (options.cross) destinations.push({ name: 'cross-device', dir: path.join(options.cross, 'nativefs-bench-out') });
+
+    destinations.forEach(function(destination) {
+      var dst = path.join(destination.dir, 'sequential.bin');
+
+      function single(name, copyOptions) {
+        list.push({
+          name: destination.name + '/sequential/' + name,
+          bytes: files.bytes, files: 1, output: destination.dir,
+          run: function() {
+            return nativefs.copy(files.sequential, dst, copyOptions);
+          }
+        });
+      }
+
+      list.push({
+        name: destination.name + '/sequential/fs.copyFile',
+        bytes: files.bytes, files: 1, output: destination.dir,
+        run: function() { return copyFile(files.sequential, dst); }
+      });
+
+      single('auto', {});
+      ['reflink', 'copy_file_range', 'sendfile', 'io_uring', 'sparse', 'direct',
+       'mmap', 'pipelined', 'buffered'].forEach(function(engine) {
+        single('engine=' + engine, { engine: engine });
+      });
+      [64 * 1024, MB, 8 * MB].forEach(function(size) {
+        single('engine=buffered,chunkSize=' + size, { engine: 'buffered', chunkSize: size });
+      });
+      [2, 4, 8].forEach(function(threads) {
+        single('parallel=' + threads, { parallel: threads });
+      });
+      ['dontneed', 'direct'].forEach(function(mode) {
+        single('cacheMode=' + mode, { cacheMode: mode });
+      });
+      ['fdatasync', 'sync_file_range', 'none'].forEach(function(mode) {
+        single('durability=' + mode, { durability: mode });
+      });
+
+      list.push({
+        name: destination.name + '/sparse/auto',
+        bytes: files.bytes, files: 1, output: destination.dir,
+        run: function() { return nativefs.copy(files.sparse, path.join(destination.dir, 'sparse.bin')); }
+      });
+      list.push({
+        name: destination.name + '/sparse/sparse=false',
+        bytes: files.bytes, files: 1, output: destination.dir,
+        run: function() {
+          return nativefs.copy(files.sparse, path.join(destination.dir, 'sparse.bin'), { sparse: false });
+        }
+      });
+
+      var names = fs.readdirSync(files.small);
+      var pairs = names.map(function(name) {
+        return { src: path.join(files.small, name), dst: path.join(destination.dir, name) };
+      });
+      var smallBytes = names.length * 4096;
+
+      list.push({
+        name: destination.name + '/small/fs.copyFile',
+        bytes: smallBytes, files: names.length, output: destination.dir,
+        run: function() {
+          return copyEach(pairs, 8, copyFile).then(function(latencies) { return { latencies: latencies }; });
+        }
+      });
+      list.push({
+        name: destination.name + '/small/copy',
+        bytes: smallBytes, files: names.length, output: destination.dir,
+        run: function() {
+          return copyEach(pairs, 8, function(src, dst) { return nativefs.copy(src, dst); })
+            .then(function(latencies) { return { latencies: latencies }; });
+        }
+      });
+      ['fsync', 'batch', 'none'].forEach(function(mode) {
+        list.push({
+          name: destination.name + '/small/copyMany,durability=' + mode,
+          bytes: smallBytes, files: names.length, output: destination.dir,
+          run: function() { return nativefs.copyMany(pairs, { durability: mode }); }
+        });
+      });
+      list.push({
+        name: destination.name + '/small/copyDir',
+        bytes: smallBytes, files: names.length, output: path.join(destination.dir, 'tree'),
+        run: function() { return nativefs.copyDir(files.small, path.join(destination.dir, 'tree')); }
+      });
+    });
+
+    return list.filter(function(entry) { return entry.name.indexOf(options.filter) >= 0; });
+  }
+
+  function measure(entry, runs) {
+    var results = [];
+
+    function once() {
+      remove(entry.output);
+      fs.mkdirSync(entry.output, { recursive: true });
+
+      var stop = loopMonitor();
+      var before = resources();
+      var began = now();
+
+      return Promise.resolve(entry.run()).then(function(info) {
+        var ms = now() - began;
+        results.push({
+          ms: ms,
+          engine: info && info.engine,
+          latencies: info && info.latencies,
+          eventLoop: stop(),
+          resources: difference(resources(), before)
+        });
+      }, function(err) {
+        stop();
+        throw err;
+      });
+    }
+
+    var chain = Promise.resolve();
+    for (var i = 0; i < runs; i++) chain = chain.then(once);
+
+    return chain.then(function() {
+      remove(entry.output);
+
+      var ms = median(results.map(function(r) { return r.ms; }));
+      var typical = results.filter(function(r) { return r.ms === ms; })[0];
+      var latencies = [].concat.apply([], results.map(function(r) { return r.latencies || []; }))
+        .sort(function(a, b) { return a - b; });
+
+      return {
+        name: entry.name,
+        engine: typical.engine || null,
+        bytes: entry.bytes,
+        files: entry.files,
+        seconds: ms / 1e3,
+        mbPerSecond: entry.bytes / MB / (ms / 1e3),
+        filesPerSecond: entry.files / (ms / 1e3),
+        latencyMs: latencies.length ? { p50: percentile(latencies, 0.5), p99: percentile(latencies, 0.99) } : null,
+        eventLoop: typical.eventLoop,
+        resources: typical.resources
+      };
+    }, function(err) {
+      remove(entry.output);
+      return { name: entry.name, error: err.code || err.message };
+    });
+  }
+
+  function main() {
+    var options = parse(process.argv.slice(2));
+    fs.mkdirSync(options.dir, { recursive: true });
+
+    var files = corpus(options);
+    var results = [];
+
+    var chain = Promise.resolve();
+    cases(files, options).forEach(function(entry) {
+      chain = chain.then(function() {
+        process.stderr.write(entry.name + '\n');
+        return measure(entry, options.runs).then(function(result) { results.push(result); });
+      });
+    });
+
+    return chain.then(function() {
+      process.stdout.write(JSON.stringify({
+        node: process.version,
+        platform: process.platform,
+        cpus: os.cpus().length,
+        options: options,
+        bufferPool: nativefs.bufferPool(),
+        results: results
+      }, null, 2) + '\n');
+    });
+  }
+
+  main().catch(function(err) {
+    console.error(err);
+    process.exit(1);
+  });
+
+})();
@@ -8,31 +8,104 @@
 
 #include <stdio.h>
 #include <io.h>
+#include <sys/utime.h>
 #include <windows.h> // for FlushFileBuffers
+#include <winioctl.h> // for FSCTL_QUERY_ALLOCATED_RANGES
 
 /* this is a totally hokey "implementation" of fsync, but
- * it works well enough.  Specifically, it doesn't bother
- * reporting errors since the below code doesn't check
- * for them anyway.
+ * it works well enough.  Any failure is reported as EIO.
  */
-void fsync(int fd) {
+int fsync(int fd) {
     HANDLE h = (HANDLE) _get_osfhandle(fd);
 
-    if (h == INVALID_HANDLE_VALUE) return;
-
-    FlushFileBuffers(h);
+    if (h == INVALID_HANDLE_VALUE || !FlushFileBuffers(h)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
 }
 
 #else
 #include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __APPLE__
+#include <copyfile.h> // for fcopyfile
+#include <sys/resource.h> // for setiopolicy_np
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/xattr.h>
+#ifndef ENOATTR
+#define ENOATTR ENODATA // what macOS calls a missing attribute
+#endif
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h> // for major() and minor()
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h> // for FICLONE
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define NATIVEFS_HAVE_IO_URING
+#endif
+#endif
+#endif
+#endif
+
+// for the hardware accelerated checksums
+#if defined(__x86_64__) || defined(_M_X64)
+#define NATIVEFS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define NATIVEFS_ARM_CRC32
+#include <arm_acle.h>
+#endif
+
+#if defined(NATIVEFS_X86) && !defined(_MSC_VER)
+// lets single functions use instructions the build doesn't assume
+#define NATIVEFS_TARGET(features) __attribute__((target(features)))
+#else
+#define NATIVEFS_TARGET(features)
 #endif
 
 #include <fcntl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
 #include <string.h>
+#include <thread>
+#include <vector>
 
 #include <node.h>
 #include <nan.h>
+#include <zlib.h> // node's own
 
 #ifdef _WIN32
 #define open  _open
@@ -43,10 +116,15 @@ void fsync(int fd) {
 
 #define O_RDONLY _O_RDONLY
 #define O_WRONLY _O_WRONLY
+#define O_RDWR   _O_RDWR
 #define O_CREAT  _O_CREAT
 #define O_TRUNC  _O_TRUNC
+#define O_EXCL   _O_EXCL
 #define O_BINARY _O_BINARY
 
+// paths are always relative to the current directory
+#define AT_FDCWD -100
+
 // needed to support files > 4GB
 #define stat __stat64
 #define fstat _fstat64
@@ -71,6 +149,10 @@ namespace NativeFS {
         return std::string(*utf8_value, len);
     }
 
+    bool equals(LocalValue value, const char* text) {
+        return value->IsString() && *Nan::Utf8String(value) == std::string(text);
+    }
+
     template <typename T>
         class Property {
             public:
@@ -83,6 +165,7 @@ namespace NativeFS {
                 T value;
 
                 friend class Args;
+                friend class Job;
                 virtual T& operator=(const T& f) { return value = f; }
         };
 
@@ -94,257 +177,6397 @@ namespace NativeFS {
 
         protected:
             friend class Args;
+            friend class Job;
             using Property<std::string>::operator=;
     };
 
-    class Args {
+    // How the bytes of a transfer actually got moved
+    enum Engine {
+        ENGINE_NONE,
+        ENGINE_BUFFERED,
+        ENGINE_SENDFILE,
+        ENGINE_COPY_FILE_RANGE,
+        ENGINE_REFLINK,
+        ENGINE_RENAME,
+        ENGINE_PIPELINED,
+        ENGINE_IO_URING,
+        ENGINE_SPARSE,
+        ENGINE_DIRECT,
+        ENGINE_INCREMENTAL,
+        ENGINE_MMAP,
+        ENGINE_FCOPYFILE,
+        ENGINE_LINK,
+        ENGINE_RESUMABLE,
+        ENGINE_GZIP,
+        ENGINE_GUNZIP,
+        ENGINE_PARALLEL,
+        ENGINE_COUNT // not an engine
+    };
+
+    const char* EngineName(Engine engine) {
+        switch (engine) {
+            case ENGINE_BUFFERED:        return "buffered";
+            case ENGINE_SENDFILE:        return "sendfile";
+            case ENGINE_COPY_FILE_RANGE: return "copy_file_range";
+            case ENGINE_REFLINK:         return "reflink";
+            case ENGINE_RENAME:          return "rename";
+            case ENGINE_PIPELINED:       return "pipelined";
+            case ENGINE_IO_URING:        return "io_uring";
+            case ENGINE_SPARSE:          return "sparse";
+            case ENGINE_DIRECT:          return "direct";
+            case ENGINE_INCREMENTAL:     return "incremental";
+            case ENGINE_MMAP:            return "mmap";
+            case ENGINE_FCOPYFILE:       return "fcopyfile";
+            case ENGINE_LINK:            return "link";
+            case ENGINE_RESUMABLE:       return "resumable";
+            case ENGINE_GZIP:            return "gzip";
+            case ENGINE_GUNZIP:          return "gunzip";
+            case ENGINE_PARALLEL:        return "parallel";
+            default:                     return "none";
+        }
+    }
+
+    // Engines that can be asked for by name with the engine option
+    bool EngineFromName(LocalValue name, Engine& engine) {
+        const Engine selectable[] = {
+            ENGINE_BUFFERED, ENGINE_SENDFILE, ENGINE_COPY_FILE_RANGE,
+            ENGINE_REFLINK, ENGINE_PIPELINED, ENGINE_IO_URING, ENGINE_SPARSE,
+            ENGINE_DIRECT, ENGINE_MMAP, ENGINE_FCOPYFILE,
+        };
+        for (Engine candidate : selectable) {
+            if (equals(name, EngineName(candidate))) {
+                engine = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Lets a transfer be paused, resumed and cancelled from the main
+    // thread.  The transfer checks it between chunks: a pause blocks it
+    // there, and a cancel makes it fail with ECANCELED, which takes the
+    // usual error path and so removes a partial destination.
+    class Control {
         public:
-            StringProperty Source;
-            StringProperty Destination;
+            Control() : state(RUNNING) {}
 
-            Property<v8::Local<v8::Function>> ProgressCallback;
-            Property<v8::Local<v8::Function>> ResultCallback;
+            void Pause() { Set(PAUSED); }
+            void Resume() { Set(RUNNING); }
+            void Cancel() { Set(CANCELLED); }
 
-            Property<bool> UpdateProgress;
+            // Returns 0, or -1 with errno set to ECANCELED
+            int Check() {
+                if (state == RUNNING) return 0;
 
-            Args(const Nan::FunctionCallbackInfo<v8::Value>& args) {
-                if (args.Length() < 3) {
-                    Nan::ThrowError("Not enough arguments");
-                    return;
-                }
-                if (!args[0]->IsString()) {
-                    Nan::ThrowTypeError("First argument is not a path");
-                    return;
-                }
-                if (!args[1]->IsString()) {
-                    Nan::ThrowTypeError("Second argument is not a path");
-                    return;
-                }
-                if (!args[2]->IsFunction()) {
-                    Nan::ThrowError("Missing result callback");
-                    return;
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return state != PAUSED; });
+                if (state == RUNNING) return 0;
+
+                errno = ECANCELED;
+                return -1;
+            }
+
+            // Sleeps for up to seconds, cut short by a pause or cancel,
+            // then does what Check() does
+            int Sleep(double seconds) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait_for(lock, std::chrono::duration<double>(seconds),
+                                     [this] { return state != RUNNING; });
                 }
-                if (args.Length() > 3 && !args[3]->IsFunction()) {
-                    Nan::ThrowError("Unknown arguments");
-                    return;
+                return Check();
+            }
+
+        private:
+            enum State { RUNNING, PAUSED, CANCELLED };
+
+            std::atomic<int> state;
+            std::mutex mutex;
+            std::condition_variable changed;
+
+            void Set(State to) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (state == CANCELLED) return; // for good
+                    state = to;
                 }
+                changed.notify_all();
+            }
+    };
+
+    // Limits a rate, in whatever units it is charged in, to so many per
+    // second; 0 is no limit.  Charges are taken as they come and whoever
+    // takes more than has built up is told how long to sleep off the
+    // difference, so a large chunk delays the copy that moved it instead
+    // of being refused.
+    class TokenBucket {
+        public:
+            TokenBucket() : rate(0), tokens(0), last(std::chrono::steady_clock::now()) {}
+
+            void SetRate(double perSecond) {
+                std::lock_guard<std::mutex> lock(mutex);
+                rate = perSecond;
+                tokens = 0;
+                last = std::chrono::steady_clock::now();
+            }
+
+            double Rate() const { return rate; }
+
+            // Returns the seconds to wait, 0 if there's no need
+            double Take(double amount) {
+                if (rate == 0 || amount <= 0) return 0;
 
-                UpdateProgress = args.Length() > 3;
+                std::lock_guard<std::mutex> lock(mutex);
+                const double perSecond = rate;
+                if (perSecond == 0) return 0;
 
-                Source      = get(args[0]);
-                Destination = get(args[1]);
+                // an idle bucket fills up to a quarter second's worth
+                const auto now = std::chrono::steady_clock::now();
+                const double elapsed = std::chrono::duration<double>(now - last).count();
+                tokens = std::min(tokens + elapsed * perSecond, perSecond / 4);
+                last = now;
 
-                ResultCallback   = (UpdateProgress ? args[3] : args[2]).As<v8::Function>();
-                ProgressCallback = args[2].As<v8::Function>();
+                tokens -= amount;
+                return tokens < 0 ? -tokens / perSecond : 0;
             }
+
+        private:
+            std::atomic<double> rate;
+            double tokens;
+            std::chrono::steady_clock::time_point last;
+            std::mutex mutex;
     };
 
-    void SendProgressUpdate(const Args& args, double completed, double total) {
-        if (args.UpdateProgress) {
-            LocalValue argv[2] = {
-                Nan::New<v8::Number>(completed),
-                Nan::New<v8::Number>(total),
-            };
-            Nan::Call(
-                Nan::Callback{ args.ProgressCallback },
-                2, argv
-            );
-        }
-    }
+    // Bandwidth (bytes per second) and IOPS limits, for one job, shared
+    // by the files of a batch or tree, or for the whole process.  Copies
+    // are charged between chunks and wait there, where a pause or cancel
+    // still gets through to them.
+    class Throttle {
+        public:
+            void Configure(double bandwidth, double iops) {
+                bytes.SetRate(bandwidth);
+                operations.SetRate(iops);
+            }
 
-    void SendComplete(const Args& args) {
-        LocalValue argv[2] = { Nan::Null(), Nan::True() };
-        Nan::Call(
-            Nan::Callback{ args.ResultCallback },
-            2, argv
-        );
-    }
+            double Bandwidth() const { return bytes.Rate(); }
+            double Iops() const { return operations.Rate(); }
 
-    void SendError(const Args& args, const char* errorText) {
-        LocalValue argv[2] = {
-            Nan::New<v8::String>(errorText).ToLocalChecked(),
-            Nan::False()
-        };
-        Nan::Call(
-            Nan::Callback{ args.ResultCallback },
-            2, argv
-        );
-    }
+            // Returns the seconds to wait for both limits
+            double Charge(double chunk, double calls) {
+                return std::max(bytes.Take(chunk), operations.Take(calls));
+            }
 
-    int doWrite(int fd, char *data, int datalen) {
-        int written = write(fd, data, datalen);
-        if (written == -1) return -1;
-        if (written < datalen) {
-            return doWrite(fd, data + written, datalen - written);
-        }
-        return written;
-    }
+            static Throttle& Global() {
+                static Throttle global;
+                return global;
+            }
 
-    const int BUFFER_SIZE = 16384;
-    void Copy(
-        int fd_in, int fd_out, ssize_t inputSize,
-        const Args& args, bool removeWhenDone = false
-    ) {
-        char buffer[BUFFER_SIZE];
+        private:
+            TokenBucket bytes;
+            TokenBucket operations;
+    };
 
-        const ssize_t bytesPerUpdate = inputSize / 100;
+    // How urgent a job's disk I/O is, for the ioPriority option
+    enum IoPriority {
+        IO_PRIORITY_NORMAL, // leave it to the OS
+        IO_PRIORITY_LOW,    // after everything else of the same class
+        IO_PRIORITY_IDLE,   // only when the disk has nothing else to do
+    };
 
-        ssize_t progress = 0;
-        ssize_t bytes_read = 0;
-        ssize_t sinceLastUpdate = 0;
+    // What a copy does to the data on the way, for the compress and
+    // decompress options
+    enum Transform {
+        TRANSFORM_NONE,
+        TRANSFORM_GZIP,
+        TRANSFORM_GUNZIP,
+    };
 
-        while ((bytes_read = read(fd_in, buffer, sizeof(buffer))) > 0)
-        {
-            ssize_t written = doWrite(fd_out, buffer, bytes_read);
-            if (written == -1) goto copyByFdError;
+    // How a batch or directory copy shares the copies of identical
+    // sources, for the dedup option
+    enum Dedup {
+        DEDUP_NONE,
+        DEDUP_LINK,    // hard links to the first copy
+        DEDUP_REFLINK, // reflinks of the first copy where possible
+    };
+
+    // Metadata a copy takes over from its source, for the preserve
+    // option
+    enum Preserve {
+        PRESERVE_TIMES     = 1,
+        PRESERVE_MODE      = 2,
+        PRESERVE_OWNERSHIP = 4,
+        PRESERVE_XATTRS    = 8,
+        PRESERVE_ALL       = 15,
+    };
+
+    // The parts of a request that can safely leave the main thread.
+    class Job {
+        public:
+            StringProperty Source;
+            StringProperty Destination;
+
+            Property<bool> UpdateProgress;
+
+            // bytes per read/write in the buffered loop; 0 means "auto"
+            Property<size_t> ChunkSize;
 
-            progress += bytes_read;
-            sinceLastUpdate += bytes_read;
+            // buffers in the reader/writer ring; 0 turns pipelining
+            // off and PIPELINE_AUTO uses it for cross-device copies
+            Property<int> Pipeline;
 
-            if (sinceLastUpdate > bytesPerUpdate) {
-                SendProgressUpdate(args, (double) progress, (double) inputSize);
-                sinceLastUpdate = 0;
+            // engine to try before the automatic choice; ENGINE_NONE
+            // leaves it all to Transfer()
+            Property<Engine> PreferredEngine;
+
+            // reads and writes kept in flight by the io_uring engine
+            Property<int> QueueDepth;
+
+            // threads copying one large file, each a range at a time; 1
+            // copies it as a single stream
+            Property<int> Parallel;
+
+            // files of a batch that are transferred at the same time
+            Property<int> Concurrency;
+
+            // copy only the allocated parts of the source; SPARSE_AUTO
+            // does so when the source looks like it has holes
+            Property<int> Sparse;
+
+            // reserve the destination's space before copying into it
+            Property<bool> Preallocate;
+
+            // least time between two progress callbacks, in milliseconds
+            Property<double> ProgressInterval;
+
+            // how the copy treats the page cache, a CacheMode
+            Property<int> Cache;
+
+            // how durable the copy is when reported done, a Durability
+            Property<int> Durability;
+
+            // write to a temporary file, only put in place when complete
+            Property<bool> Atomic;
+
+            // digest computed while copying, a ChecksumType
+            Property<int> Checksum;
+
+            // read the destination back and compare digests
+            Property<bool> Verify;
+
+            // only write what differs from an existing destination
+            Property<bool> Incremental;
+
+            // what happens to an existing destination, a ReplaceMode
+            Property<int> Replace;
+
+            // most files copied at once to or from a spinning disk
+            Property<int> RotationalConcurrency;
+
+            // source metadata applied to the destination, Preserve flags
+            Property<int> Preserve;
+
+            // what duplicate sources in a batch get, a Dedup
+            Property<int> Dedup;
+
+            // whether sources count as duplicates with the same
+            // contents, rather than only when they are the same file
+            Property<bool> DedupContent;
+
+            // whether an interrupted copy leaves its destination and a
+            // journal behind, for the next one to carry on from
+            Property<bool> Resume;
+
+            // pauses and cancels the transfer; empty if nothing can
+            Property<std::shared_ptr<Control>> Controls;
+
+            // a Transform the data goes through, the zlib level to
+            // compress it at and the threads to do that on, 0 for one
+            // per core
+            Property<int> Transform;
+            Property<int> CompressionLevel;
+            Property<int> CompressionThreads;
+
+            // the job's own bandwidth and IOPS limits, if it has any;
+            // Throttle::Global() applies as well
+            Property<std::shared_ptr<Throttle>> Limits;
+
+            // an IoPriority for the threads doing the copying
+            Property<int> IoPriority;
+
+            // Blocks while the transfer is paused.  Returns 0, or -1 with
+            // errno set to ECANCELED once it has been cancelled.
+            int Checkpoint() const {
+                const std::shared_ptr<Control>& control = Controls;
+                return control ? control->Check() : 0;
             }
-        }
 
-        if (bytes_read == -1) goto copyByFdError;
+            // Checkpoint() after waiting for up to seconds, which a pause
+            // or cancel cuts short
+            int Wait(double seconds) const {
+                const std::shared_ptr<Control>& control = Controls;
+                if (control) return control->Sleep(seconds);
+                std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+                return 0;
+            }
 
-        // send one last progress update
-        SendProgressUpdate(args, (double) inputSize, (double) inputSize);
+            // The same options applied to one file of a batch
+            Job ForFile(const std::string& source, const std::string& destination) const {
+                Job job(*this);
+                job.Source = source;
+                job.Destination = destination;
+                job.UpdateProgress = false;
+                return job;
+            }
 
-        close(fd_in);
+            // The options for a duplicate of a file already copied to
+            // copy, which is read instead of the source and shared if
+            // the filesystem can
+            Job ForDuplicate(const std::string& copy) const {
+                Job job(*this);
+                job.Source = copy;
+                job.PreferredEngine = ENGINE_REFLINK;
+                job.Transform = TRANSFORM_NONE; // done already
+                return job;
+            }
 
-        fsync(fd_out); // Flush
-        close(fd_out);
+            // A file of a directory copy, which always keeps its mode
+            // and timestamps
+            Job ForTreeFile(const std::string& source, const std::string& destination) const {
+                Job job = ForFile(source, destination);
+                job.Preserve = job.Preserve | PRESERVE_MODE | PRESERVE_TIMES;
+                return job;
+            }
+    };
 
-        if (removeWhenDone) {
-            remove(args.Source);
-        }
+    struct Paths {
+        std::string Source;
+        std::string Destination;
+    };
 
-        SendComplete(args);
-        return;
+    const double DEFAULT_PROGRESS_INTERVAL = 50;
 
-    copyByFdError:
-        close(fd_in);
-        close(fd_out);
+    enum CacheMode {
+        CACHE_DEFAULT,  // leave it to the OS
+        CACHE_DONTNEED, // evict the copied data as the copy goes along
+        CACHE_DIRECT,   // bypass the cache altogether
+    };
 
-        remove(args.Destination); // remove failed copy
-        SendError(args, strerror(errno));
-        return;
-    }
+    enum ChecksumType {
+        CHECKSUM_NONE,
+        CHECKSUM_CRC32C,
+        CHECKSUM_XXHASH64,
+        CHECKSUM_SHA256,
+    };
 
-    NAN_METHOD(Copy) {
-        Args args(info);
+    enum ReplaceMode {
+        REPLACE_ALWAYS,   // overwrite it
+        REPLACE_NEVER,    // fail with EEXIST
+        REPLACE_EXCHANGE, // moves only: swap the two
+    };
 
-        int out, in = open(args.Source, O_RDONLY | O_BINARY);
-        if (in < 0) goto copyByPathError;
+    enum Durability {
+        DURABILITY_FULL,  // fsync every file
+        DURABILITY_DATA,  // fdatasync, skipping metadata a read doesn't need
+        DURABILITY_RANGE, // write back during the copy, then fdatasync
+        DURABILITY_BATCH, // sync the destinations once the batch is done
+        DURABILITY_NONE,  // leave it to the OS
+    };
 
+    const int SPARSE_AUTO = -1;
 
-        struct stat st;
+    const int PIPELINE_AUTO = -1;
+    const int DEFAULT_PIPELINE_DEPTH = 4;
+    const int MAX_PIPELINE_DEPTH = 64;
 
-        // Get the input file information
-        if (fstat(in, &st) != 0) {
-            close(in);
-            goto copyByPathError;
-        }
+    const int DEFAULT_QUEUE_DEPTH = 8;
+    const int MAX_QUEUE_DEPTH = 128;
 
-        out = open(args.Destination, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, st.st_mode);
-        if (out < 0) {
-            close(in);
-            goto copyByPathError;
-        }
+    const int MAX_PARALLEL = 64;
 
-        Copy(in, out, st.st_size, args);
-        return;
+    const int DEFAULT_CONCURRENCY = 8;
+    const int MAX_CONCURRENCY = 256;
+    const int DEFAULT_ROTATIONAL_CONCURRENCY = 1;
 
-    copyByPathError:
-        remove(args.Destination); // remove failed copy
-        SendError(args, strerror(errno));
-        return;
+    // Upper bound for an explicit chunkSize option
+    const size_t MAX_CHUNK_SIZE = 1024 * 1024 * 1024;
+
+    LocalValue option(v8::Local<v8::Object> options, const char* name) {
+        return Nan::Get(options, Nan::New<v8::String>(name).ToLocalChecked())
+            .ToLocalChecked();
     }
 
-    NAN_METHOD(Move) {
-        Args args(info);
+    // The JS side of a Control, made by nativefs.controller() and given
+    // to transfers as the controller option.  One controller can drive
+    // any number of them.
+    class Controller : public Nan::ObjectWrap {
+        public:
+            static Nan::Persistent<v8::FunctionTemplate> type;
 
-        int out, in = open(args.Source, O_RDONLY | O_BINARY);
-        if (in < 0) goto moveError;
+            static void Init() {
+                v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(New);
+                tpl->SetClassName(Nan::New<v8::String>("Controller").ToLocalChecked());
+                tpl->InstanceTemplate()->SetInternalFieldCount(1);
 
-        struct stat in_stats;
+                Nan::SetPrototypeMethod(tpl, "pause", Pause);
+                Nan::SetPrototypeMethod(tpl, "resume", Resume);
+                Nan::SetPrototypeMethod(tpl, "cancel", Cancel);
 
-        // Get the input file information
-        if (fstat(in, &in_stats) != 0) {
-            close(in);
-            goto moveError;
-        }
+                type.Reset(tpl);
+            }
 
-        // Open target
-        out = open(args.Destination, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, in_stats.st_mode);
-        if (out < 0) {
-            close(in);
-            goto moveError;
-        }
+            static v8::Local<v8::Object> Create() {
+                v8::Local<v8::Function> constructor =
+                    Nan::GetFunction(Nan::New(type)).ToLocalChecked();
+                return Nan::NewInstance(constructor, 0, nullptr).ToLocalChecked();
+            }
 
-        struct stat out_stats;
+            // null if the value isn't a controller
+            static std::shared_ptr<Control> From(LocalValue value) {
+                if (!value->IsObject() || !Nan::New(type)->HasInstance(value)) return nullptr;
+                return Nan::ObjectWrap::Unwrap<Controller>(value.As<v8::Object>())->control;
+            }
 
-        // Get the output file information
-        if (fstat(out, &out_stats) != 0) {
-            close(in);
-            close(out);
-            goto moveError;
-        }
+            // An abort listener for an AbortSignal, cancelling the
+            // controller it was made for
+            static v8::Local<v8::Function> Listener(v8::Local<v8::Object> controller) {
+                return Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Cancel, controller)).ToLocalChecked();
+            }
 
-        {
-            const ssize_t inputSize = in_stats.st_size;
-            if (in_stats.st_dev == out_stats.st_dev) {
-                close(in);
-                close(out);
+        private:
+            std::shared_ptr<Control> control;
 
-                // These files are on the same device; it would
-                // be much quicker to just rename the file
-                remove(args.Destination);
-                rename(args.Source, args.Destination);
+            Controller() : control(std::make_shared<Control>()) {}
 
-                SendProgressUpdate(args, (double) inputSize, (double) inputSize);
-                SendComplete(args);
+            static NAN_METHOD(New) {
+                Controller* controller = new Controller();
+                controller->Wrap(info.This());
+                info.GetReturnValue().Set(info.This());
             }
-            else {
-                // They're on different devices.  We'll need to
-                // do this as a copy followed by a remove.
-                Copy(in, out, inputSize, args, /* removeWhenDone: */ true);
+
+            // Cancel is also called as a listener, with the controller
+            // as its data
+            static std::shared_ptr<Control> Self(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+                LocalValue self = info.Data()->IsObject() ? info.Data() : LocalValue(info.This());
+                std::shared_ptr<Control> control = From(self);
+                if (!control) Nan::ThrowTypeError("Not a controller");
+                return control;
             }
-        }
-        return;
 
-    moveError:
-        remove(args.Destination); // remove failed copy
-        SendError(args, strerror(errno));
-        return;
-    }
+            static NAN_METHOD(Pause) {
+                if (std::shared_ptr<Control> control = Self(info)) control->Pause();
+            }
 
-    NAN_MODULE_INIT(InitAll) {
-        Nan::Set(target,
-            Nan::New<v8::String>("copy").ToLocalChecked(),
-            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Copy)).ToLocalChecked()
-        );
-        Nan::Set(target,
-            Nan::New<v8::String>("move").ToLocalChecked(),
-            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Move)).ToLocalChecked()
-        );
-    }
+            static NAN_METHOD(Resume) {
+                if (std::shared_ptr<Control> control = Self(info)) control->Resume();
+            }
 
-    NODE_MODULE(native_fs, InitAll)
-}  // namespace NativeFS
+            static NAN_METHOD(Cancel) {
+                if (std::shared_ptr<Control> control = Self(info)) control->Cancel();
+            }
+    };
 
-#ifdef _WIN32
-#undef open
-#undef read
-#undef write
-#undef close
+    Nan::Persistent<v8::FunctionTemplate> Controller::type;
 
-#undef O_RDONLY
-#undef O_WRONLY
-#undef O_CREAT
-#undef O_TRUNC
+    class Args : public Job {
+        public:
+            Property<v8::Local<v8::Function>> ProgressCallback;
+            Property<v8::Local<v8::Function>> ResultCallback;
+
+            // the files of a batch, empty for single transfers
+            Property<std::vector<Paths>> Files;
+
+            // no result callback was given, so the call returns a promise
+            Property<bool> ReturnsPromise;
+
+            // false if parsing threw a JS exception
+            Property<bool> Valid;
+
+            // (source, destination, [options], [progress], [result]) or,
+            // for a batch, ([{ src, dst }, ...], [options], [progress], [result]).
+            // Without a result callback the call returns a promise, and
+            // the progress callback can be given as options.onProgress.
+            Args(const Nan::FunctionCallbackInfo<v8::Value>& args, bool batch = false) {
+                Valid = false;
+
+                UpdateProgress = false;
+                ChunkSize = 0;
+                Pipeline = PIPELINE_AUTO;
+                PreferredEngine = ENGINE_NONE;
+                QueueDepth = DEFAULT_QUEUE_DEPTH;
+                Parallel = 1;
+                Concurrency = DEFAULT_CONCURRENCY;
+                Sparse = SPARSE_AUTO;
+                Preallocate = true;
+                ProgressInterval = DEFAULT_PROGRESS_INTERVAL;
+                Cache = CACHE_DEFAULT;
+                Durability = DURABILITY_FULL;
+                Atomic = false;
+                Checksum = CHECKSUM_NONE;
+                Verify = false;
+                Incremental = false;
+                Replace = REPLACE_ALWAYS;
+                RotationalConcurrency = DEFAULT_ROTATIONAL_CONCURRENCY;
+                Preserve = 0;
+                Dedup = DEDUP_NONE;
+                DedupContent = false;
+                Resume = false;
+                IoPriority = IO_PRIORITY_NORMAL;
+                Transform = TRANSFORM_NONE;
+                CompressionLevel = Z_DEFAULT_COMPRESSION;
+                CompressionThreads = 0;
+
+                ReturnsPromise = false;
+
+                if (args.Length() < (batch ? 1 : 2)) {
+                    Nan::ThrowError("Not enough arguments");
+                    return;
+                }
+                if (batch) {
+                    if (!args[0]->IsArray()) {
+                        Nan::ThrowTypeError("First argument is not an array");
+                        return;
+                    }
+                    if (!Batch(args[0].As<v8::Array>())) return;
+                }
+                else {
+                    if (!args[0]->IsString()) {
+                        Nan::ThrowTypeError("First argument is not a path");
+                        return;
+                    }
+                    if (!args[1]->IsString()) {
+                        Nan::ThrowTypeError("Second argument is not a path");
+                        return;
+                    }
+                }
+
+                int next = batch ? 1 : 2;
+                if (args[next]->IsObject() && !args[next]->IsFunction()) {
+                    if (!Options(args[next].As<v8::Object>())) return;
+                    next++;
+                }
+
+                const int callbacks = std::max(0, args.Length() - next);
+                if (callbacks > 0 && !args[next]->IsFunction()) {
+                    Nan::ThrowError("Missing result callback");
+                    return;
+                }
+                if (callbacks > 2 || (callbacks == 2 && !args[next + 1]->IsFunction())) {
+                    Nan::ThrowError("Unknown arguments");
+                    return;
+                }
+
+                if (!batch) {
+                    Source      = get(args[0]);
+                    Destination = get(args[1]);
+                    if (Source->empty() || Destination->empty()) return;
+                }
+
+                ReturnsPromise = callbacks == 0;
+
+                if (callbacks == 2) {
+                    UpdateProgress   = true;
+                    ProgressCallback = args[next].As<v8::Function>();
+                }
+                if (callbacks > 0) {
+                    ResultCallback = args[next + callbacks - 1].As<v8::Function>();
+                }
+
+                Valid = true;
+            }
+
+            // For copy and move: one file has no batch to wait for, and
+            // isn't worth syncing a whole filesystem for
+            void SingleFile() {
+                if (Durability == DURABILITY_BATCH) Durability = DURABILITY_DATA;
+            }
+
+        private:
+            bool Batch(v8::Local<v8::Array> entries) {
+                std::vector<Paths> files(entries->Length());
+
+                for (uint32_t i = 0; i < entries->Length(); i++) {
+                    LocalValue entry = Nan::Get(entries, i).ToLocalChecked();
+                    if (!entry->IsObject()) {
+                        Nan::ThrowTypeError("Batch entries must be { src, dst } objects");
+                        return false;
+                    }
+
+                    LocalValue src = option(entry.As<v8::Object>(), "src");
+                    LocalValue dst = option(entry.As<v8::Object>(), "dst");
+                    if (!src->IsString() || !dst->IsString()) {
+                        Nan::ThrowTypeError("Batch entries must be { src, dst } objects");
+                        return false;
+                    }
+
+                    files[i].Source = get(src);
+                    files[i].Destination = get(dst);
+                    if (files[i].Source.empty() || files[i].Destination.empty()) return false;
+                }
+
+                Files = files;
+                return true;
+            }
+
+            bool Options(v8::Local<v8::Object> options) {
+                LocalValue onProgress = option(options, "onProgress");
+                if (onProgress->IsFunction()) {
+                    UpdateProgress   = true;
+                    ProgressCallback = onProgress.As<v8::Function>();
+                }
+                else if (!onProgress->IsUndefined()) {
+                    Nan::ThrowTypeError("onProgress must be a function");
+                    return false;
+                }
+
+                LocalValue chunkSize = option(options, "chunkSize");
+                if (chunkSize->IsNumber()) {
+                    double size = Nan::To<double>(chunkSize).FromJust();
+                    if (!(size >= 1 && size <= MAX_CHUNK_SIZE)) {
+                        Nan::ThrowRangeError("chunkSize is out of range");
+                        return false;
+                    }
+                    ChunkSize = (size_t) size;
+                }
+                else if (!chunkSize->IsUndefined() && !equals(chunkSize, "auto")) {
+                    Nan::ThrowTypeError("chunkSize must be a number or \"auto\"");
+                    return false;
+                }
+
+                LocalValue pipeline = option(options, "pipeline");
+                if (pipeline->IsBoolean()) {
+                    Pipeline = Nan::To<bool>(pipeline).FromJust() ? DEFAULT_PIPELINE_DEPTH : 0;
+                }
+                else if (pipeline->IsNumber()) {
+                    double depth = Nan::To<double>(pipeline).FromJust();
+                    if (!(depth >= 2 && depth <= MAX_PIPELINE_DEPTH)) {
+                        Nan::ThrowRangeError("pipeline must be between 2 and 64 buffers");
+                        return false;
+                    }
+                    Pipeline = (int) depth;
+                }
+                else if (!pipeline->IsUndefined() && !equals(pipeline, "auto")) {
+                    Nan::ThrowTypeError("pipeline must be a boolean, a number or \"auto\"");
+                    return false;
+                }
+
+                LocalValue sparse = option(options, "sparse");
+                if (sparse->IsBoolean()) {
+                    Sparse = Nan::To<bool>(sparse).FromJust() ? 1 : 0;
+                }
+                else if (!sparse->IsUndefined() && !equals(sparse, "auto")) {
+                    Nan::ThrowTypeError("sparse must be a boolean or \"auto\"");
+                    return false;
+                }
+
+                LocalValue preallocate = option(options, "preallocate");
+                if (preallocate->IsBoolean()) {
+                    Preallocate = Nan::To<bool>(preallocate).FromJust();
+                }
+                else if (!preallocate->IsUndefined()) {
+                    Nan::ThrowTypeError("preallocate must be a boolean");
+                    return false;
+                }
+
+                LocalValue atomic = option(options, "atomic");
+                if (atomic->IsBoolean()) {
+                    Atomic = Nan::To<bool>(atomic).FromJust();
+                }
+                else if (!atomic->IsUndefined()) {
+                    Nan::ThrowTypeError("atomic must be a boolean");
+                    return false;
+                }
+
+                LocalValue checksum = option(options, "checksum");
+                if (equals(checksum, "crc32c")) {
+                    Checksum = CHECKSUM_CRC32C;
+                }
+                else if (equals(checksum, "xxhash64")) {
+                    Checksum = CHECKSUM_XXHASH64;
+                }
+                else if (equals(checksum, "sha256")) {
+                    Checksum = CHECKSUM_SHA256;
+                }
+                else if (!checksum->IsUndefined()) {
+                    Nan::ThrowTypeError("checksum must be \"crc32c\", \"xxhash64\" or \"sha256\"");
+                    return false;
+                }
+
+                LocalValue verify = option(options, "verify");
+                if (verify->IsBoolean()) {
+                    Verify = Nan::To<bool>(verify).FromJust();
+                }
+                else if (!verify->IsUndefined()) {
+                    Nan::ThrowTypeError("verify must be a boolean");
+                    return false;
+                }
+
+                // verifying needs a digest, and the cheapest will do
+                if (Verify && Checksum == CHECKSUM_NONE) {
+                    Checksum = CHECKSUM_CRC32C;
+                }
+
+                LocalValue incremental = option(options, "incremental");
+                if (incremental->IsBoolean()) {
+                    Incremental = Nan::To<bool>(incremental).FromJust();
+                }
+                else if (!incremental->IsUndefined()) {
+                    Nan::ThrowTypeError("incremental must be a boolean");
+                    return false;
+                }
+
+                LocalValue replace = option(options, "replace");
+                if (replace->IsBoolean()) {
+                    Replace = Nan::To<bool>(replace).FromJust() ? REPLACE_ALWAYS : REPLACE_NEVER;
+                }
+                else if (equals(replace, "exchange")) {
+                    Replace = REPLACE_EXCHANGE;
+                }
+                else if (!replace->IsUndefined()) {
+                    Nan::ThrowTypeError("replace must be a boolean or \"exchange\"");
+                    return false;
+                }
+
+                LocalValue preserve = option(options, "preserve");
+                if (preserve->IsBoolean()) {
+                    Preserve = Nan::To<bool>(preserve).FromJust() ? PRESERVE_ALL : 0;
+                }
+                else if (preserve->IsArray()) {
+                    const std::pair<const char*, int> kinds[] = {
+                        { "times", PRESERVE_TIMES },
+                        { "mode", PRESERVE_MODE },
+                        { "ownership", PRESERVE_OWNERSHIP },
+                        { "xattrs", PRESERVE_XATTRS },
+                    };
+                    v8::Local<v8::Array> list = preserve.As<v8::Array>();
+
+                    int flags = 0;
+                    for (uint32_t i = 0; i < list->Length(); i++) {
+                        LocalValue name = Nan::Get(list, i).ToLocalChecked();
+                        int flag = 0;
+                        for (const auto& kind : kinds) {
+                            if (equals(name, kind.first)) flag = kind.second;
+                        }
+                        if (flag == 0) {
+                            Nan::ThrowTypeError("preserve takes \"times\", \"mode\", \"ownership\" and \"xattrs\"");
+                            return false;
+                        }
+                        flags |= flag;
+                    }
+                    Preserve = flags;
+                }
+                else if (!preserve->IsUndefined()) {
+                    Nan::ThrowTypeError("preserve must be a boolean or an array");
+                    return false;
+                }
+
+                LocalValue dedup = option(options, "dedup");
+                if (equals(dedup, "link")) {
+                    Dedup = DEDUP_LINK;
+                }
+                else if (equals(dedup, "reflink")) {
+                    Dedup = DEDUP_REFLINK;
+                }
+                else if (!dedup->IsUndefined() && !dedup->IsFalse()) {
+                    Nan::ThrowTypeError("dedup must be \"link\", \"reflink\" or false");
+                    return false;
+                }
+
+                LocalValue dedupContent = option(options, "dedupContent");
+                if (dedupContent->IsBoolean()) {
+                    DedupContent = Nan::To<bool>(dedupContent).FromJust();
+                }
+                else if (!dedupContent->IsUndefined()) {
+                    Nan::ThrowTypeError("dedupContent must be a boolean");
+                    return false;
+                }
+
+                const char* transforms[2] = { "compress", "decompress" };
+                for (int i = 0; i < 2; i++) {
+                    LocalValue format = option(options, transforms[i]);
+                    if (equals(format, "gzip")) {
+                        if (Transform != TRANSFORM_NONE) {
+                            Nan::ThrowTypeError("compress and decompress can't both be given");
+                            return false;
+                        }
+                        Transform = i == 0 ? TRANSFORM_GZIP : TRANSFORM_GUNZIP;
+                    }
+                    else if (!format->IsUndefined() && !format->IsFalse()) {
+                        Nan::ThrowTypeError((std::string(transforms[i]) + " must be \"gzip\" or false").c_str());
+                        return false;
+                    }
+                }
+
+                LocalValue level = option(options, "compressionLevel");
+                if (level->IsNumber()) {
+                    double value = Nan::To<double>(level).FromJust();
+                    if (!(value >= 1 && value <= 9)) {
+                        Nan::ThrowRangeError("compressionLevel must be between 1 and 9");
+                        return false;
+                    }
+                    CompressionLevel = (int) value;
+                }
+                else if (!level->IsUndefined()) {
+                    Nan::ThrowTypeError("compressionLevel must be a number");
+                    return false;
+                }
+
+                LocalValue compressors = option(options, "compressionThreads");
+                if (compressors->IsNumber()) {
+                    double threads = Nan::To<double>(compressors).FromJust();
+                    if (!(threads >= 1 && threads <= MAX_PARALLEL)) {
+                        Nan::ThrowRangeError("compressionThreads must be between 1 and 64");
+                        return false;
+                    }
+                    CompressionThreads = (int) threads;
+                }
+                else if (!compressors->IsUndefined()) {
+                    Nan::ThrowTypeError("compressionThreads must be a number");
+                    return false;
+                }
+
+                // the destination doesn't hold the source's bytes
+                if (Transform != TRANSFORM_NONE && (Verify || Incremental)) {
+                    Nan::ThrowTypeError("compress and decompress can't be combined with verify or incremental");
+                    return false;
+                }
+
+                LocalValue resume = option(options, "resume");
+                if (resume->IsBoolean()) {
+                    Resume = Nan::To<bool>(resume).FromJust();
+                }
+                else if (!resume->IsUndefined()) {
+                    Nan::ThrowTypeError("resume must be a boolean");
+                    return false;
+                }
+
+                // the partial destination is what gets resumed, so it
+                // has to keep its name and be written over
+                if (Resume && (Atomic || Incremental || Replace != REPLACE_ALWAYS || Transform != TRANSFORM_NONE)) {
+                    Nan::ThrowTypeError("resume can't be combined with atomic, incremental, replace or compression");
+                    return false;
+                }
+
+                LocalValue progressInterval = option(options, "progressInterval");
+                if (progressInterval->IsNumber()) {
+                    double interval = Nan::To<double>(progressInterval).FromJust();
+                    if (!(interval >= 0)) {
+                        Nan::ThrowRangeError("progressInterval must not be negative");
+                        return false;
+                    }
+                    ProgressInterval = interval;
+                }
+                else if (!progressInterval->IsUndefined()) {
+                    Nan::ThrowTypeError("progressInterval must be a number");
+                    return false;
+                }
+
+                LocalValue cacheMode = option(options, "cacheMode");
+                if (equals(cacheMode, "direct")) {
+                    Cache = CACHE_DIRECT;
+                }
+                else if (equals(cacheMode, "dontneed")) {
+                    Cache = CACHE_DONTNEED;
+                }
+                else if (!cacheMode->IsUndefined() && !equals(cacheMode, "default")) {
+                    Nan::ThrowTypeError("cacheMode must be \"default\", \"dontneed\" or \"direct\"");
+                    return false;
+                }
+
+                LocalValue durability = option(options, "durability");
+                if (durability->IsUndefined() || equals(durability, "fsync")) {
+                    Durability = DURABILITY_FULL;
+                }
+                else if (equals(durability, "fdatasync")) {
+                    Durability = DURABILITY_DATA;
+                }
+                else if (equals(durability, "sync_file_range")) {
+                    Durability = DURABILITY_RANGE;
+                }
+                else if (equals(durability, "batch")) {
+                    Durability = DURABILITY_BATCH;
+                }
+                else if (equals(durability, "none")) {
+                    Durability = DURABILITY_NONE;
+                }
+                else {
+                    Nan::ThrowTypeError("durability must be \"fsync\", \"fdatasync\", \"sync_file_range\", \"batch\" or \"none\"");
+                    return false;
+                }
+
+                LocalValue engine = option(options, "engine");
+                if (!engine->IsUndefined() && !equals(engine, "auto")) {
+                    Engine preferred;
+                    if (!EngineFromName(engine, preferred)) {
+                        Nan::ThrowTypeError("Unknown engine");
+                        return false;
+                    }
+                    PreferredEngine = preferred;
+                }
+
+                LocalValue queueDepth = option(options, "queueDepth");
+                if (queueDepth->IsNumber()) {
+                    double depth = Nan::To<double>(queueDepth).FromJust();
+                    if (!(depth >= 1 && depth <= MAX_QUEUE_DEPTH)) {
+                        Nan::ThrowRangeError("queueDepth must be between 1 and 128");
+                        return false;
+                    }
+                    QueueDepth = (int) depth;
+                }
+                else if (!queueDepth->IsUndefined()) {
+                    Nan::ThrowTypeError("queueDepth must be a number");
+                    return false;
+                }
+
+                LocalValue parallel = option(options, "parallel");
+                if (parallel->IsNumber()) {
+                    double threads = Nan::To<double>(parallel).FromJust();
+                    if (!(threads >= 1 && threads <= MAX_PARALLEL)) {
+                        Nan::ThrowRangeError("parallel must be between 1 and 64");
+                        return false;
+                    }
+                    Parallel = (int) threads;
+                }
+                else if (!parallel->IsUndefined()) {
+                    Nan::ThrowTypeError("parallel must be a number");
+                    return false;
+                }
+
+                LocalValue concurrency = option(options, "concurrency");
+                if (concurrency->IsNumber()) {
+                    double limit = Nan::To<double>(concurrency).FromJust();
+                    if (!(limit >= 1 && limit <= MAX_CONCURRENCY)) {
+                        Nan::ThrowRangeError("concurrency must be between 1 and 256");
+                        return false;
+                    }
+                    Concurrency = (int) limit;
+                }
+                else if (!concurrency->IsUndefined()) {
+                    Nan::ThrowTypeError("concurrency must be a number");
+                    return false;
+                }
+
+                LocalValue rotational = option(options, "rotationalConcurrency");
+                if (rotational->IsNumber()) {
+                    double limit = Nan::To<double>(rotational).FromJust();
+                    if (!(limit >= 1 && limit <= MAX_CONCURRENCY)) {
+                        Nan::ThrowRangeError("rotationalConcurrency must be between 1 and 256");
+                        return false;
+                    }
+                    RotationalConcurrency = (int) limit;
+                }
+                else if (!rotational->IsUndefined()) {
+                    Nan::ThrowTypeError("rotationalConcurrency must be a number");
+                    return false;
+                }
+
+                double limits[2] = { 0, 0 };
+                const char* limitNames[2] = { "bandwidth", "iops" };
+                for (int i = 0; i < 2; i++) {
+                    LocalValue value = option(options, limitNames[i]);
+                    if (value->IsUndefined()) continue;
+
+                    double rate = value->IsNumber() ? Nan::To<double>(value).FromJust() : -1;
+                    if (!(rate >= 0 && std::isfinite(rate))) {
+                        Nan::ThrowRangeError((std::string(limitNames[i]) + " must be a rate per second").c_str());
+                        return false;
+                    }
+                    limits[i] = rate;
+                }
+                if (limits[0] > 0 || limits[1] > 0) {
+                    std::shared_ptr<Throttle> throttle = std::make_shared<Throttle>();
+                    throttle->Configure(limits[0], limits[1]);
+                    Limits = throttle;
+                }
+
+                LocalValue ioPriority = option(options, "ioPriority");
+                if (equals(ioPriority, "low")) {
+                    IoPriority = IO_PRIORITY_LOW;
+                }
+                else if (equals(ioPriority, "idle")) {
+                    IoPriority = IO_PRIORITY_IDLE;
+                }
+                else if (!ioPriority->IsUndefined() && !equals(ioPriority, "normal")) {
+                    Nan::ThrowTypeError("ioPriority must be \"normal\", \"low\" or \"idle\"");
+                    return false;
+                }
+
+                LocalValue controller = option(options, "controller");
+                if (!controller->IsUndefined()) {
+                    Controls = Controller::From(controller);
+                    if (!Controls->get()) {
+                        Nan::ThrowTypeError("controller must come from nativefs.controller()");
+                        return false;
+                    }
+                }
+
+                // an AbortSignal cancels the controller, or one made for it
+                LocalValue signal = option(options, "signal");
+                if (signal->IsObject()) {
+                    v8::Local<v8::Object> target = signal.As<v8::Object>();
+                    LocalValue listen = option(target, "addEventListener");
+                    if (!listen->IsFunction()) {
+                        Nan::ThrowTypeError("signal must be an AbortSignal");
+                        return false;
+                    }
+
+                    v8::Local<v8::Object> handle = controller->IsUndefined()
+                        ? Controller::Create() : controller.As<v8::Object>();
+                    std::shared_ptr<Control> control = Controller::From(handle);
+                    Controls = control;
+
+                    if (option(target, "aborted")->IsTrue()) {
+                        control->Cancel();
+                    }
+                    else {
+                        LocalValue argv[2] = {
+                            Nan::New<v8::String>("abort").ToLocalChecked(), Controller::Listener(handle)
+                        };
+                        if (Nan::Call(listen.As<v8::Function>(), target, 2, argv).IsEmpty()) return false;
+                    }
+                }
+                else if (!signal->IsUndefined()) {
+                    Nan::ThrowTypeError("signal must be an AbortSignal");
+                    return false;
+                }
+
+                return true;
+            }
+    };
+
+    struct Progress {
+        double completed;
+        double total;
+        double bytes; // batches only; -1 otherwise
+    };
+
+    // Receives progress from the copy loop.  Always called on the
+    // thread that is doing the copying, never on the main thread.
+    class Reporter {
+        public:
+            virtual ~Reporter() {}
+            virtual void Update(double completed, double total) = 0;
+
+            // Progress of an operation on many files.  May be called
+            // from several threads at once.
+            virtual void UpdateFiles(double done, double total, double bytes) {}
+    };
+
+    // Filled in by the worker thread, handed to the result callback
+    struct Stats {
+        Engine engine;
+        double bytes;
+        std::string checksum; // hex, empty unless asked for
+        double written;       // by incremental and transforming copies, -1 otherwise
+        double resumed;       // skipped by resumable copies, -1 otherwise
+
+        // read and write calls that moved data; a copy_file_range or
+        // sendfile call counts as one of each
+        double reads;
+        double writes;
+
+        // milliseconds spent opening the files, moving the data,
+        // flushing it, reading it back and renaming it into place
+        double openTime;
+        double transferTime;
+        double flushTime;
+        double verifyTime;
+        double renameTime;
+
+        Stats() : engine(ENGINE_NONE), bytes(0), written(-1), resumed(-1), reads(0), writes(0),
+                  openTime(0), transferTime(0), flushTime(0), verifyTime(0), renameTime(0) {}
+    };
+
+    // Milliseconds between laps, for the times in Stats
+    class Stopwatch {
+        public:
+            Stopwatch() : last(std::chrono::steady_clock::now()) {}
+
+            double Lap() {
+                const auto now = std::chrono::steady_clock::now();
+                const std::chrono::duration<double, std::milli> elapsed = now - last;
+                last = now;
+                return elapsed.count();
+            }
+
+        private:
+            std::chrono::steady_clock::time_point last;
+    };
+
+    // Totals over every file transferred by the process, for
+    // nativefs.stats().  Updated once per file, so a lock will do.
+    class Telemetry {
+        public:
+            struct Totals {
+                double files;    // transferred
+                double failures; // files that failed
+                double bytes;
+                double reads;
+                double writes;
+                double openTime;
+                double transferTime;
+                double flushTime;
+                double verifyTime;
+                double renameTime;
+                double engines[ENGINE_COUNT]; // files per Engine
+            };
+
+            static Telemetry& Shared() {
+                static Telemetry telemetry;
+                return telemetry;
+            }
+
+            void Record(const Stats& stats, int error) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error != 0) {
+                    totals.failures++;
+                    return;
+                }
+
+                totals.files++;
+                totals.bytes += stats.bytes;
+                totals.reads += stats.reads;
+                totals.writes += stats.writes;
+                totals.openTime += stats.openTime;
+                totals.transferTime += stats.transferTime;
+                totals.flushTime += stats.flushTime;
+                totals.verifyTime += stats.verifyTime;
+                totals.renameTime += stats.renameTime;
+                totals.engines[stats.engine]++;
+            }
+
+            Totals Get() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return totals;
+            }
+
+        private:
+            std::mutex mutex;
+            Totals totals;
+
+            Telemetry() : totals() {}
+    };
+
+    // Keeps a bulk copy from pushing everything else out of the page
+    // cache, for cacheMode "dontneed" and as the fallback for "direct",
+    // and writes the destination back as it goes for durability
+    // "range".  Every CACHE_WINDOW bytes, writeback of the newest window
+    // is started, the one before it is waited for, and (unless only the
+    // writeback was asked for) both files' pages up to there are
+    // dropped.  Dirty pages can't be dropped, hence the writeback;
+    // lagging by a window keeps the copy from stalling on it.
+    class CacheDropper {
+        public:
+            CacheDropper(int fd_in, int fd_out, const Job& job)
+                : fd_in(fd_in), fd_out(fd_out), drop(job.Cache != CACHE_DEFAULT),
+                  enabled(drop || job.Durability == DURABILITY_RANGE),
+                  flushed(0), started(0)
+            {
+#if defined(POSIX_FADV_SEQUENTIAL)
+                if (drop) posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(F_NOCACHE)
+                // the closest macOS has: no caching for either file
+                if (drop) {
+                    fcntl(fd_in, F_NOCACHE, 1);
+                    fcntl(fd_out, F_NOCACHE, 1);
+                }
+#endif
+            }
+
+            // position: bytes of the file copied so far
+            void Advance(int64_t position) {
+                if (!enabled || position - started < CACHE_WINDOW) return;
+
+#ifdef __linux__
+                sync_file_range(fd_out, started, position - started, SYNC_FILE_RANGE_WRITE);
+                sync_file_range(fd_out, flushed, started - flushed,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+                if (drop) {
+                    posix_fadvise(fd_out, flushed, started - flushed, POSIX_FADV_DONTNEED);
+                    posix_fadvise(fd_in, flushed, position - flushed, POSIX_FADV_DONTNEED);
+                }
+#endif
+
+                flushed = started;
+                started = position;
+            }
+
+            // Once the destination has been flushed, nothing of either
+            // file needs to stay cached.
+            void Finish() {
+#ifdef POSIX_FADV_DONTNEED
+                if (!drop) return;
+                posix_fadvise(fd_in, 0, 0, POSIX_FADV_DONTNEED);
+                posix_fadvise(fd_out, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+            }
+
+        private:
+            static const int64_t CACHE_WINDOW = 8 * 1024 * 1024;
+
+            const int fd_in, fd_out;
+            const bool drop;
+            const bool enabled;
+
+            int64_t flushed; // written back (and dropped) up to here
+            int64_t started; // writeback started up to here
+    };
+
+    // The durability a copy gets.  A move is about to delete the only
+    // other copy, so it always gets at least an fdatasync.
+    int EffectiveDurability(const Job& job, bool moving) {
+        const int durability = job.Durability;
+        if (moving && (durability == DURABILITY_BATCH || durability == DURABILITY_NONE)) {
+            return DURABILITY_DATA;
+        }
+        return durability;
+    }
+
+    // Makes a finished copy as durable as the job asks for.  Returns 0,
+    // or -1 with errno set if the data may not have reached the disk.
+    // Destinations like FIFOs and /dev/null have nothing to sync and
+    // fail with EINVAL, which is no failure of the copy.
+    int Flush(int fd, const Job& job, bool moving) {
+        int result;
+        switch (EffectiveDurability(job, moving)) {
+            case DURABILITY_FULL:
+                result = fsync(fd);
+                break;
+#ifndef __linux__
+            // without syncfs() there's no cheap way to flush a batch
+            // later, so its files are flushed one by one after all
+            case DURABILITY_BATCH:
+#endif
+            case DURABILITY_DATA:
+            case DURABILITY_RANGE:
+#if defined(_WIN32) || defined(__APPLE__)
+                result = fsync(fd);
+#else
+                result = fdatasync(fd);
+#endif
+                break;
+            default:
+                return 0;
+        }
+        return result == -1 && (errno == EINVAL || errno == ENOTSUP) ? 0 : result;
+    }
+
+#ifdef _WIN32
+    const char* const PATH_SEPARATORS = "/\\";
+#else
+    const char* const PATH_SEPARATORS = "/";
+#endif
+
+#ifdef _WIN32
+    // The errno closest to a Win32 error code
+    int ErrnoFromWindows(DWORD error) {
+        switch (error) {
+            case ERROR_FILE_NOT_FOUND:
+            case ERROR_PATH_NOT_FOUND:    return ENOENT;
+            case ERROR_FILE_EXISTS:
+            case ERROR_ALREADY_EXISTS:    return EEXIST;
+            case ERROR_ACCESS_DENIED:
+            case ERROR_SHARING_VIOLATION: return EACCES;
+            case ERROR_NOT_SAME_DEVICE:   return EXDEV;
+            case ERROR_DISK_FULL:         return ENOSPC;
+            default:                      return EIO;
+        }
+    }
+#endif
+
+    // How the destination is opened: verifying reads it back, an
+    // incremental copy compares against what is already there, and a
+    // resumable one checks where it left off
+    int OutputAccess(const Job& job) {
+        return job.Verify || job.Incremental || job.Resume ? O_RDWR : O_WRONLY;
+    }
+
+    // What happens to an existing destination when it is opened: it is
+    // truncated, unless it is to be patched incrementally, resumed or kept
+    int OutputTruncate(const Job& job) {
+        if (job.Replace == REPLACE_NEVER) return O_EXCL;
+        return job.Incremental || job.Resume ? 0 : O_TRUNC;
+    }
+
+    int statPath(const std::string& path, struct stat& st) {
+#ifdef _WIN32
+        return _stat64(path.c_str(), &st);
+#else
+        return stat(path.c_str(), &st);
+#endif
+    }
+
+#ifndef _WIN32
+    void getTimes(const struct stat& st, struct timespec times[2]) {
+#ifdef __APPLE__
+        times[0] = st.st_atimespec;
+        times[1] = st.st_mtimespec;
+#else
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+#endif
+    }
+#endif
+
+    // For incremental copies: a destination with the source's size and
+    // modification time is taken to be up to date.  A checksum has to
+    // be computed from the data, so it always reads it.
+    bool UpToDate(const Job& job, const struct stat& source, const struct stat& destination) {
+        if (job.Checksum != CHECKSUM_NONE) return false;
+        if ((destination.st_mode & S_IFMT) != S_IFREG || source.st_size != destination.st_size) {
+            return false;
+        }
+#ifdef _WIN32
+        return source.st_mtime == destination.st_mtime;
+#else
+        struct timespec a[2], b[2];
+        getTimes(source, a);
+        getTimes(destination, b);
+        return a[1].tv_sec == b[1].tv_sec && a[1].tv_nsec == b[1].tv_nsec;
+#endif
+    }
+
+#ifndef _WIN32
+#ifdef __APPLE__
+    // macOS's versions take a position and options as well
+    ssize_t flistxattr(int fd, char* names, size_t size) {
+        return ::flistxattr(fd, names, size, 0);
+    }
+    ssize_t fgetxattr(int fd, const char* name, void* value, size_t size) {
+        return ::fgetxattr(fd, name, value, size, 0, 0);
+    }
+    int fsetxattr(int fd, const char* name, const void* value, size_t size, int flags) {
+        return ::fsetxattr(fd, name, value, size, 0, flags);
+    }
+#endif
+
+    // Copies every extended attribute, which includes POSIX ACLs on
+    // Linux (system.posix_acl_access).  Attributes the destination
+    // won't take (a namespace we aren't privileged for, or none at all
+    // on its filesystem) are skipped.  Returns 0, or -1 with errno set.
+    int CopyXattrs(int fd_in, int fd_out) {
+        std::vector<char> names;
+        for (;;) {
+            ssize_t size = flistxattr(fd_in, nullptr, 0);
+            if (size == -1) return errno == ENOTSUP ? 0 : -1;
+            if (size == 0) return 0;
+
+            names.resize((size_t) size);
+            size = flistxattr(fd_in, names.data(), names.size());
+            if (size >= 0) {
+                names.resize((size_t) size);
+                break;
+            }
+            if (errno != ERANGE) return -1; // otherwise it grew in between
+        }
+
+        std::vector<char> value;
+        for (size_t i = 0; i < names.size(); i += strlen(&names[i]) + 1) {
+            const char* name = &names[i];
+
+            ssize_t size;
+            for (;;) {
+                size = fgetxattr(fd_in, name, nullptr, 0);
+                if (size == -1) break;
+
+                value.resize((size_t) size);
+                size = fgetxattr(fd_in, name, value.data(), value.size());
+                if (size >= 0 || errno != ERANGE) break;
+            }
+            if (size == -1) {
+                if (errno == ENOATTR || errno == EPERM || errno == EACCES) continue; // gone, or not ours to read
+                return -1;
+            }
+
+            if (fsetxattr(fd_out, name, value.data(), (size_t) size, 0) == -1) {
+                if (errno == EPERM || errno == EACCES || errno == ENOTSUP) continue;
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+
+    // Gives the destination the source's metadata, as far as
+    // job.Preserve asks, through the open descriptors.  What the
+    // filesystem or our privileges don't allow (xattrs on tmpfs,
+    // handing a file to another user) is skipped rather than failing
+    // the copy.  Times go last, since the other changes touch them.
+    // An incremental copy always takes the timestamps, so UpToDate()
+    // knows it next time.  Returns 0, or -1 with errno set.
+    int CopyMetadata(int fd_in, int fd_out, const struct stat& st, const Job& job) {
+        const int preserve = job.Preserve | (job.Incremental ? PRESERVE_TIMES : 0);
+        if (preserve == 0) return 0;
+
+#ifdef _WIN32
+        // ownership and extended attributes are left alone
+        if ((preserve & (PRESERVE_TIMES | PRESERVE_MODE)) == 0) return 0;
+
+        FILE_BASIC_INFO info;
+        if (!GetFileInformationByHandleEx((HANDLE) _get_osfhandle(fd_in), FileBasicInfo, &info, sizeof(info))) {
+            errno = ErrnoFromWindows(GetLastError());
+            return -1;
+        }
+
+        // zeros leave a field unchanged
+        info.ChangeTime.QuadPart = 0;
+        if ((preserve & PRESERVE_TIMES) == 0) {
+            info.CreationTime.QuadPart = info.LastAccessTime.QuadPart = info.LastWriteTime.QuadPart = 0;
+        }
+        if ((preserve & PRESERVE_MODE) == 0) info.FileAttributes = 0;
+
+        if (!SetFileInformationByHandle((HANDLE) _get_osfhandle(fd_out), FileBasicInfo, &info, sizeof(info))) {
+            errno = ErrnoFromWindows(GetLastError());
+            return -1;
+        }
+        return 0;
+#else
+        if (preserve & PRESERVE_XATTRS) {
+            if (CopyXattrs(fd_in, fd_out) == -1) return -1;
+        }
+
+        // without the privilege to give the file away, the group may
+        // still be one of ours
+        if ((preserve & PRESERVE_OWNERSHIP) &&
+            fchown(fd_out, st.st_uid, st.st_gid) == -1 &&
+            (errno != EPERM || (fchown(fd_out, (uid_t) -1, st.st_gid) == -1 && errno != EPERM))) {
+            return -1;
+        }
+
+        // after fchown(), which clears the set-user-ID bits
+        if ((preserve & PRESERVE_MODE) && fchmod(fd_out, st.st_mode & 07777) == -1) return -1;
+
+        if (preserve & PRESERVE_TIMES) {
+            struct timespec times[2];
+            getTimes(st, times);
+            if (futimens(fd_out, times) == -1) return -1;
+        }
+        return 0;
+#endif
+    }
+
+    // The directory a path's entry lives in
+    std::string Parent(const std::string& path) {
+        const size_t slash = path.find_last_of(PATH_SEPARATORS);
+        if (slash == std::string::npos) return ".";
+        if (slash == 0) return "/";
+        return path.substr(0, slash);
+    }
+
+    // For durability "batch": makes everything written to the given
+    // directories durable in one go, once all their files are done.
+    // On Linux that is one syncfs() per filesystem, which also covers
+    // the directory entries, and everything else dirty on it; elsewhere
+    // the files have already been flushed and only the directories are
+    // left.
+    int SyncDirectories(const std::vector<std::string>& dirs) {
+#ifdef _WIN32
+        return 0; // directories can't be flushed from user mode
+#else
+        std::vector<dev_t> synced;
+        std::vector<std::string> seen;
+
+        for (const std::string& dir : dirs) {
+            if (std::find(seen.begin(), seen.end(), dir) != seen.end()) continue;
+            seen.push_back(dir);
+
+            int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd == -1) return errno;
+
+            int result = 0;
+#ifdef __linux__
+            struct stat st;
+            if (fstat(fd, &st) == -1) {
+                int error = errno;
+                close(fd);
+                return error;
+            }
+            if (std::find(synced.begin(), synced.end(), st.st_dev) != synced.end()) {
+                close(fd);
+                continue;
+            }
+            synced.push_back(st.st_dev);
+            result = syncfs(fd);
+#else
+            result = fsync(fd);
+#endif
+            int error = errno;
+            close(fd);
+            if (result == -1) return error;
+        }
+        return 0;
+#endif
+    }
+
+    // Makes the entry for path, looked up in dir (which may be
+    // AT_FDCWD), durable by flushing the directory it is in: a synced
+    // file can still vanish in a crash if its name never made it to the
+    // disk.  Returns 0, or -1 with errno set.  Like Flush(), it lets
+    // directories that can't be synced go: one that can't be opened
+    // for reading (a write-only drop box) or whose filesystem doesn't
+    // sync directories.
+    int SyncEntry(int dir, const std::string& path) {
+#ifdef _WIN32
+        return 0; // NTFS journals its directory changes
+#else
+        int fd = openat(dir, Parent(path).c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd == -1) return errno == EACCES ? 0 : -1;
+
+        int result = fsync(fd);
+        int error = errno;
+        close(fd);
+        errno = error;
+        return result == -1 && (error == EINVAL || error == ENOTSUP) ? 0 : result;
+#endif
+    }
+
+    // Lowercase hex of bytes, most significant first
+    std::string Hex(const unsigned char* bytes, size_t size) {
+        static const char digits[] = "0123456789abcdef";
+
+        std::string hex(size * 2, '0');
+        for (size_t i = 0; i < size; i++) {
+            hex[2 * i] = digits[bytes[i] >> 4];
+            hex[2 * i + 1] = digits[bytes[i] & 15];
+        }
+        return hex;
+    }
+
+    // The optional instructions the checksums use, looked up once
+    struct CpuFeatures {
+        bool crc32c; // SSE4.2 or the ARMv8 CRC extension
+        bool sha;    // the SHA extensions, with the SSSE3/SSE4.1 they build on
+
+        CpuFeatures() : crc32c(false), sha(false) {
+#if defined(NATIVEFS_X86)
+            unsigned int regs[4] = { 0, 0, 0, 0 };
+#ifdef _MSC_VER
+            __cpuid((int*) regs, 0);
+            const unsigned int leaves = regs[0];
+            __cpuid((int*) regs, 1);
+#else
+            const unsigned int leaves = __get_cpuid_max(0, nullptr);
+            __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+            const bool ssse3 = (regs[2] & (1u << 9)) != 0;
+            const bool sse41 = (regs[2] & (1u << 19)) != 0;
+            crc32c = (regs[2] & (1u << 20)) != 0;
+
+            if (leaves >= 7) {
+#ifdef _MSC_VER
+                __cpuidex((int*) regs, 7, 0);
+#else
+                __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+                sha = ssse3 && sse41 && (regs[1] & (1u << 29)) != 0;
+            }
+#elif defined(NATIVEFS_ARM_CRC32)
+            crc32c = true; // the compiler was told it can count on it
+#endif
+        }
+
+        static const CpuFeatures& Get() {
+            static const CpuFeatures features;
+            return features;
+        }
+    };
+
+    // Digests the data of a transfer as it goes through userspace
+    class Hasher {
+        public:
+            virtual ~Hasher() {}
+
+            virtual void Update(const char* data, size_t size) = 0;
+
+            // Digest of everything so far, in hex.  Only called once.
+            virtual std::string Digest() = 0;
+
+            // for the holes of a sparse copy, which read back as zeros
+            void Zeros(int64_t size) {
+                static const char zeros[64 * 1024] = { 0 };
+                while (size > 0) {
+                    const size_t chunk = (size_t) std::min(size, (int64_t) sizeof(zeros));
+                    Update(zeros, chunk);
+                    size -= chunk;
+                }
+            }
+
+            // Returns nullptr for CHECKSUM_NONE
+            static Hasher* Create(int type);
+    };
+
+    // CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs
+    class Crc32c : public Hasher {
+        public:
+            Crc32c() : crc(0xFFFFFFFF), hardware(CpuFeatures::Get().crc32c) {}
+
+            void Update(const char* data, size_t size) override {
+                crc = hardware ? Hardware(crc, data, size) : Software(crc, data, size);
+            }
+
+            std::string Digest() override {
+                const uint32_t value = ~crc;
+                const unsigned char bytes[4] = {
+                    (unsigned char) (value >> 24), (unsigned char) (value >> 16),
+                    (unsigned char) (value >> 8), (unsigned char) value
+                };
+                return Hex(bytes, sizeof(bytes));
+            }
+
+        private:
+            uint32_t crc;
+            const bool hardware;
+
+            // eight tables, for eight bytes per step
+            struct Tables {
+                uint32_t table[8][256];
+
+                Tables() {
+                    for (uint32_t i = 0; i < 256; i++) {
+                        uint32_t value = i;
+                        for (int bit = 0; bit < 8; bit++) {
+                            value = (value >> 1) ^ (0x82F63B78 & (0 - (value & 1)));
+                        }
+                        table[0][i] = value;
+                    }
+                    for (int k = 1; k < 8; k++) {
+                        for (int i = 0; i < 256; i++) {
+                            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+                        }
+                    }
+                }
+            };
+
+            static uint32_t Software(uint32_t crc, const char* data, size_t size) {
+                static const Tables tables;
+                const uint32_t (*t)[256] = tables.table;
+                const unsigned char* p = (const unsigned char*) data;
+
+                while (size >= 8) {
+                    crc = t[7][(crc ^ p[0]) & 0xFF] ^ t[6][((crc >> 8) ^ p[1]) & 0xFF] ^
+                          t[5][((crc >> 16) ^ p[2]) & 0xFF] ^ t[4][(crc >> 24) ^ p[3]] ^
+                          t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+                    p += 8;
+                    size -= 8;
+                }
+                while (size-- > 0) {
+                    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+                }
+                return crc;
+            }
+
+#if defined(NATIVEFS_X86)
+            NATIVEFS_TARGET("sse4.2")
+            static uint32_t Hardware(uint32_t crc, const char* data, size_t size) {
+                uint64_t wide = crc;
+                for (; size >= 8; data += 8, size -= 8) {
+                    uint64_t value;
+                    memcpy(&value, data, 8);
+                    wide = _mm_crc32_u64(wide, value);
+                }
+                crc = (uint32_t) wide;
+                for (; size > 0; data++, size--) {
+                    crc = _mm_crc32_u8(crc, (unsigned char) *data);
+                }
+                return crc;
+            }
+#elif defined(NATIVEFS_ARM_CRC32)
+            static uint32_t Hardware(uint32_t crc, const char* data, size_t size) {
+                for (; size >= 8; data += 8, size -= 8) {
+                    uint64_t value;
+                    memcpy(&value, data, 8);
+                    crc = __crc32cd(crc, value);
+                }
+                for (; size > 0; data++, size--) {
+                    crc = __crc32cb(crc, (unsigned char) *data);
+                }
+                return crc;
+            }
+#else
+            static uint32_t Hardware(uint32_t crc, const char* data, size_t size) {
+                return Software(crc, data, size);
+            }
+#endif
+    };
+
+    // XXH64 with a seed of 0
+    class XxHash64 : public Hasher {
+        public:
+            XxHash64() : length(0), buffered(0) {
+                acc[0] = PRIME1 + PRIME2;
+                acc[1] = PRIME2;
+                acc[2] = 0;
+                acc[3] = 0 - PRIME1;
+            }
+
+            void Update(const char* data, size_t size) override {
+                length += size;
+
+                if (buffered > 0) {
+                    const size_t take = std::min(size, sizeof(buffer) - buffered);
+                    memcpy(buffer + buffered, data, take);
+                    buffered += take;
+                    data += take;
+                    size -= take;
+
+                    if (buffered < sizeof(buffer)) return;
+                    Stripe(buffer);
+                    buffered = 0;
+                }
+
+                for (; size >= sizeof(buffer); data += sizeof(buffer), size -= sizeof(buffer)) {
+                    Stripe(data);
+                }
+
+                memcpy(buffer, data, size);
+                buffered = size;
+            }
+
+            std::string Digest() override {
+                uint64_t hash;
+                if (length >= sizeof(buffer)) {
+                    hash = Rotate(acc[0], 1) + Rotate(acc[1], 7) + Rotate(acc[2], 12) + Rotate(acc[3], 18);
+                    for (int i = 0; i < 4; i++) {
+                        hash = (hash ^ Round(0, acc[i])) * PRIME1 + PRIME4;
+                    }
+                }
+                else {
+                    hash = PRIME5;
+                }
+                hash += length;
+
+                const char* p = buffer;
+                size_t left = buffered;
+                for (; left >= 8; p += 8, left -= 8) {
+                    hash ^= Round(0, Read64(p));
+                    hash = Rotate(hash, 27) * PRIME1 + PRIME4;
+                }
+                if (left >= 4) {
+                    hash ^= (uint64_t) Read32(p) * PRIME1;
+                    hash = Rotate(hash, 23) * PRIME2 + PRIME3;
+                    p += 4;
+                    left -= 4;
+                }
+                for (; left > 0; p++, left--) {
+                    hash ^= (uint64_t) (unsigned char) *p * PRIME5;
+                    hash = Rotate(hash, 11) * PRIME1;
+                }
+
+                hash ^= hash >> 33;
+                hash *= PRIME2;
+                hash ^= hash >> 29;
+                hash *= PRIME3;
+                hash ^= hash >> 32;
+
+                unsigned char bytes[8];
+                for (int i = 0; i < 8; i++) bytes[i] = (unsigned char) (hash >> (56 - 8 * i));
+                return Hex(bytes, sizeof(bytes));
+            }
+
+        private:
+            static const uint64_t PRIME1 = 11400714785074694791ULL;
+            static const uint64_t PRIME2 = 14029467366897019727ULL;
+            static const uint64_t PRIME3 = 1609587929392839161ULL;
+            static const uint64_t PRIME4 = 9650029242287828579ULL;
+            static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+            uint64_t acc[4];
+            uint64_t length;
+            char buffer[32];
+            size_t buffered;
+
+            static uint64_t Rotate(uint64_t value, int bits) {
+                return (value << bits) | (value >> (64 - bits));
+            }
+
+            static uint64_t Round(uint64_t acc, uint64_t input) {
+                return Rotate(acc + input * PRIME2, 31) * PRIME1;
+            }
+
+            // little-endian, whatever the CPU
+            static uint64_t Read64(const char* p) {
+                uint64_t value = 0;
+                for (int i = 7; i >= 0; i--) value = (value << 8) | (unsigned char) p[i];
+                return value;
+            }
+
+            static uint32_t Read32(const char* p) {
+                uint32_t value = 0;
+                for (int i = 3; i >= 0; i--) value = (value << 8) | (unsigned char) p[i];
+                return value;
+            }
+
+            void Stripe(const char* p) {
+                for (int i = 0; i < 4; i++) acc[i] = Round(acc[i], Read64(p + 8 * i));
+            }
+    };
+
+    // SHA-256, with the x86 SHA extensions where the CPU has them
+    class Sha256 : public Hasher {
+        public:
+            Sha256() : length(0), buffered(0), hardware(CpuFeatures::Get().sha) {
+                static const uint32_t initial[8] = {
+                    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+                };
+                memcpy(state, initial, sizeof(state));
+            }
+
+            void Update(const char* data, size_t size) override {
+                length += size;
+
+                if (buffered > 0) {
+                    const size_t take = std::min(size, sizeof(buffer) - buffered);
+                    memcpy(buffer + buffered, data, take);
+                    buffered += take;
+                    data += take;
+                    size -= take;
+
+                    if (buffered < sizeof(buffer)) return;
+                    Blocks((const unsigned char*) buffer, 1);
+                    buffered = 0;
+                }
+
+                const size_t blocks = size / sizeof(buffer);
+                if (blocks > 0) {
+                    Blocks((const unsigned char*) data, blocks);
+                    data += blocks * sizeof(buffer);
+                    size -= blocks * sizeof(buffer);
+                }
+
+                memcpy(buffer, data, size);
+                buffered = size;
+            }
+
+            std::string Digest() override {
+                const uint64_t bits = length * 8;
+
+                // a 1 bit, zeros up to 8 bytes short of a block, the length
+                unsigned char padding[72] = { 0x80 };
+                const size_t zeros = (buffered < 56 ? 56 : 120) - buffered;
+                for (int i = 0; i < 8; i++) padding[zeros + i] = (unsigned char) (bits >> (56 - 8 * i));
+                Update((const char*) padding, zeros + 8);
+
+                unsigned char bytes[32];
+                for (int i = 0; i < 32; i++) bytes[i] = (unsigned char) (state[i / 4] >> (24 - 8 * (i % 4)));
+                return Hex(bytes, sizeof(bytes));
+            }
+
+        private:
+            uint32_t state[8];
+            uint64_t length;
+            char buffer[64];
+            size_t buffered;
+            const bool hardware;
+
+            static const uint32_t* K() {
+                static const uint32_t k[64] = {
+                    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+                };
+                return k;
+            }
+
+            void Blocks(const unsigned char* data, size_t blocks) {
+#if defined(NATIVEFS_X86)
+                if (hardware) {
+                    Hardware(state, data, blocks);
+                    return;
+                }
+#endif
+                Software(state, data, blocks);
+            }
+
+            static uint32_t Rotate(uint32_t value, int bits) {
+                return (value >> bits) | (value << (32 - bits));
+            }
+
+            static void Software(uint32_t state[8], const unsigned char* data, size_t blocks) {
+                const uint32_t* k = K();
+
+                for (; blocks > 0; blocks--, data += 64) {
+                    uint32_t w[64];
+                    for (int i = 0; i < 16; i++) {
+                        w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 |
+                               (uint32_t) data[4 * i + 2] << 8 | (uint32_t) data[4 * i + 3];
+                    }
+                    for (int i = 16; i < 64; i++) {
+                        const uint32_t s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                        const uint32_t s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+                    }
+
+                    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+                    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+                    for (int i = 0; i < 64; i++) {
+                        const uint32_t t1 = h + (Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25)) +
+                                            ((e & f) ^ (~e & g)) + k[i] + w[i];
+                        const uint32_t t2 = (Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22)) +
+                                            ((a & b) ^ (a & c) ^ (b & c));
+                        h = g; g = f; f = e; e = d + t1;
+                        d = c; c = b; b = a; a = t1 + t2;
+                    }
+
+                    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+                    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+                }
+            }
+
+#if defined(NATIVEFS_X86)
+            // Four rounds per step: each sha256rnds2 does two, and the
+            // message schedule is extended four words at a time.
+            NATIVEFS_TARGET("sha,ssse3,sse4.1")
+            static void Hardware(uint32_t state[8], const unsigned char* data, size_t blocks) {
+                const uint32_t* k = K();
+                const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+                // the instructions want the state as ABEF and CDGH
+                __m128i dcba = _mm_loadu_si128((const __m128i*) &state[0]);
+                __m128i hgfe = _mm_loadu_si128((const __m128i*) &state[4]);
+                __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+                __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+                __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+                __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+                for (; blocks > 0; blocks--, data += 64) {
+                    const __m128i abefStart = abef, cdghStart = cdgh;
+
+                    __m128i w[16];
+                    for (int i = 0; i < 4; i++) {
+                        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * i)), swap);
+                    }
+                    for (int i = 4; i < 16; i++) {
+                        const __m128i extended = _mm_add_epi32(
+                            _mm_sha256msg1_epu32(w[i - 4], w[i - 3]),
+                            _mm_alignr_epi8(w[i - 1], w[i - 2], 4)
+                        );
+                        w[i] = _mm_sha256msg2_epu32(extended, w[i - 1]);
+                    }
+
+                    for (int i = 0; i < 16; i++) {
+                        __m128i message = _mm_add_epi32(w[i], _mm_loadu_si128((const __m128i*) &k[4 * i]));
+                        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+                        message = _mm_shuffle_epi32(message, 0x0E);
+                        abef = _mm_sha256rnds2_epu32(abef, cdgh, message);
+                    }
+
+                    abef = _mm_add_epi32(abef, abefStart);
+                    cdgh = _mm_add_epi32(cdgh, cdghStart);
+                }
+
+                __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+                __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+                _mm_storeu_si128((__m128i*) &state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+                _mm_storeu_si128((__m128i*) &state[4], _mm_alignr_epi8(dchg, feba, 8));
+            }
+#endif
+    };
+
+    Hasher* Hasher::Create(int type) {
+        switch (type) {
+            case CHECKSUM_CRC32C:   return new Crc32c();
+            case CHECKSUM_XXHASH64: return new XxHash64();
+            case CHECKSUM_SHA256:   return new Sha256();
+            default:                return nullptr;
+        }
+    }
+
+    // Turns the raw byte counts coming out of a transfer engine into
+    // progress updates, roughly one for every 1% of the input.  With a
+    // hasher, the engines that see the data pass it in order, and a
+    // sparse copy passes the length of each hole.
+    class ProgressTracker {
+        public:
+            ProgressTracker(const Job& job, Reporter& reporter, int64_t inputSize,
+                            CacheDropper* dropper = nullptr, Hasher* hasher = nullptr)
+                : job(job), reporter(reporter), dropper(dropper), hasher(hasher), inputSize(inputSize),
+                  bytesPerUpdate(inputSize / 100), progress(0), sinceLastUpdate(0),
+                  readCalls(0), writeCalls(0) {}
+
+            // engines that don't see the data can't be used
+            bool Hashing() const {
+                return hasher != nullptr;
+            }
+
+            // These are where engines get paused or cancelled: they
+            // return -1 with errno set to ECANCELED if the copy should
+            // stop, and 0 otherwise.
+            // Each chunk counts as one read and one write unless the
+            // engine says otherwise.
+            int Add(const char* data, int64_t bytes, int reads = 1, int writes = 1) {
+                if (hasher != nullptr) hasher->Update(data, bytes);
+                return Add(bytes, reads, writes);
+            }
+
+            int AddHole(int64_t bytes) {
+                if (hasher != nullptr) hasher->Zeros(bytes);
+                return Skip(bytes);
+            }
+
+            int Add(int64_t bytes, int reads = 1, int writes = 1) {
+                return Advance(bytes, bytes, reads, writes);
+            }
+
+            // For engines whose progress comes out of order: the cache
+            // dropper takes it as a high-water mark, so it is left to
+            // drop everything once the copy is done
+            void Unordered() {
+                dropper = nullptr;
+            }
+
+            // progress that took no I/O (holes, what a resumed copy
+            // already has), so it isn't throttled
+            int Skip(int64_t bytes) {
+                return Advance(bytes, 0, 0, 0);
+            }
+
+            // send one last progress update
+            void Finish() {
+                Send((double) inputSize);
+            }
+
+            double Reads() const { return readCalls; }
+            double Writes() const { return writeCalls; }
+
+            // bytes done so far
+            int64_t Progress() const { return progress; }
+
+        private:
+            const Job& job;
+            Reporter& reporter;
+            CacheDropper* dropper;
+            Hasher* const hasher;
+
+            const int64_t inputSize;
+            const int64_t bytesPerUpdate;
+
+            int64_t progress;
+            int64_t sinceLastUpdate;
+
+            double readCalls;
+            double writeCalls;
+
+            // bytes of progress, of which moved were actually read or written
+            int Advance(int64_t bytes, int64_t moved, int reads, int writes) {
+                readCalls += reads;
+                writeCalls += writes;
+                progress += bytes;
+                sinceLastUpdate += bytes;
+
+                if (dropper != nullptr) dropper->Advance(progress);
+
+                if (sinceLastUpdate > bytesPerUpdate) {
+                    Send((double) progress);
+                    sinceLastUpdate = 0;
+                }
+
+                const std::shared_ptr<Throttle>& limits = job.Limits;
+                double wait = Throttle::Global().Charge((double) moved, reads + writes);
+                if (limits) wait = std::max(wait, limits->Charge((double) moved, reads + writes));
+
+                return wait > 0 ? job.Wait(wait) : job.Checkpoint();
+            }
+
+            void Send(double completed) {
+                if (job.UpdateProgress) {
+                    reporter.Update(completed, (double) inputSize);
+                }
+            }
+    };
+
+    // The most a single read or write call is asked to move.  Windows
+    // counts in unsigned ints and Linux moves at most 0x7ffff000 bytes a
+    // call, so anything larger is split up here.
+    const int64_t IO_CALL_LIMIT = 1024 * 1024 * 1024;
+
+#ifndef _WIN32
+    // For descriptors that turn out to be non-blocking, a FIFO opened by
+    // someone else say: waits until fd is ready for events
+    void WaitReady(int fd, short events) {
+        struct pollfd ready = { fd, events, 0 };
+        while (poll(&ready, 1, -1) == -1 && errno == EINTR) {}
+    }
+#endif
+
+    // One read of up to size bytes, retried when a signal interrupts
+    // it.  Returns what read() does.
+    ssize_t doRead(int fd, char* data, int64_t size) {
+        const unsigned chunk = (unsigned) std::min(size, IO_CALL_LIMIT);
+        for (;;) {
+            ssize_t got = read(fd, data, chunk);
+            if (got != -1) return got;
+            if (errno == EINTR) continue;
+#ifndef _WIN32
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                WaitReady(fd, POLLIN);
+                continue;
+            }
+#endif
+            return -1;
+        }
+    }
+
+    // Writes all of data, in as many calls as that takes.  Returns size,
+    // or -1 with errno set; done, if given, gets how much was written
+    // either way.
+    int64_t doWrite(int fd, const char* data, int64_t size, int64_t* done = nullptr) {
+        int64_t total = 0;
+        while (total < size) {
+            const unsigned chunk = (unsigned) std::min(size - total, IO_CALL_LIMIT);
+            ssize_t written = write(fd, data + total, chunk);
+            if (written > 0) {
+                total += written;
+                continue;
+            }
+            if (written == -1 && errno == EINTR) continue;
+#ifndef _WIN32
+            if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                WaitReady(fd, POLLOUT);
+                continue;
+            }
+#endif
+            if (written == 0) errno = EIO; // no progress, and no reason why
+
+            if (done != nullptr) *done = total;
+            return -1;
+        }
+
+        if (done != nullptr) *done = total;
+        return total;
+    }
+
+    // doRead() and doWrite() at an offset, leaving the file position
+    // alone (on Windows it moves), so threads can share a descriptor
+    ssize_t doReadAt(int fd, char* data, int64_t size, int64_t offset) {
+        const unsigned chunk = (unsigned) std::min(size, IO_CALL_LIMIT);
+        for (;;) {
+#ifdef _WIN32
+            OVERLAPPED at;
+            memset(&at, 0, sizeof(at));
+            at.Offset = (DWORD) offset;
+            at.OffsetHigh = (DWORD) (offset >> 32);
+
+            DWORD got;
+            if (ReadFile((HANDLE) _get_osfhandle(fd), data, chunk, &got, &at)) return (ssize_t) got;
+            if (GetLastError() == ERROR_HANDLE_EOF) return 0;
+            errno = ErrnoFromWindows(GetLastError());
+            return -1;
+#else
+            ssize_t got = pread(fd, data, chunk, (off_t) offset);
+            if (got == -1 && errno == EINTR) continue;
+            return got;
+#endif
+        }
+    }
+
+    int64_t doWriteAt(int fd, const char* data, int64_t size, int64_t offset) {
+        int64_t total = 0;
+        while (total < size) {
+            const unsigned chunk = (unsigned) std::min(size - total, IO_CALL_LIMIT);
+#ifdef _WIN32
+            OVERLAPPED at;
+            memset(&at, 0, sizeof(at));
+            at.Offset = (DWORD) (offset + total);
+            at.OffsetHigh = (DWORD) ((offset + total) >> 32);
+
+            DWORD written;
+            if (!WriteFile((HANDLE) _get_osfhandle(fd), data + total, chunk, &written, &at)) {
+                errno = ErrnoFromWindows(GetLastError());
+                return -1;
+            }
+#else
+            ssize_t written = pwrite(fd, data + total, chunk, (off_t) (offset + total));
+            if (written == -1 && errno == EINTR) continue;
+            if (written == -1) return -1;
+#endif
+            if (written == 0) {
+                errno = EIO;
+                return -1;
+            }
+            total += written;
+        }
+        return total;
+    }
+
+    class BufferPool;
+
+    // Buffers borrowed from the pool, all of the same size and aligned
+    // to the page, which covers direct I/O.  They go back to the pool
+    // when the lease ends.  An empty lease means memory ran out.
+    class BufferLease {
+        public:
+            BufferLease() : pool(nullptr), size(0) {}
+
+            BufferLease(BufferLease&& other)
+                : pool(other.pool), buffers(std::move(other.buffers)), size(other.size) {
+                other.pool = nullptr;
+                other.buffers.clear();
+            }
+
+            BufferLease& operator=(BufferLease&& other) {
+                if (this != &other) {
+                    Release();
+                    pool = other.pool;
+                    buffers = std::move(other.buffers);
+                    size = other.size;
+                    other.pool = nullptr;
+                    other.buffers.clear();
+                }
+                return *this;
+            }
+
+            ~BufferLease() {
+                Release();
+            }
+
+            explicit operator bool() const { return !buffers.empty(); }
+
+            char* operator[](size_t index) const { return buffers[index]; }
+            char* get() const { return buffers[0]; }
+            size_t Count() const { return buffers.size(); }
+
+            // For buffers the kernel may still be using: they are never
+            // handed out again, nor freed.
+            void Abandon();
+
+        private:
+            friend class BufferPool;
+
+            BufferPool* pool;
+            std::vector<char*> buffers;
+            size_t size; // of each buffer, rounded up to its size class
+
+            void Release();
+
+            BufferLease(const BufferLease&) = delete;
+            BufferLease& operator=(const BufferLease&) = delete;
+    };
+
+    // Every transfer buffer comes from here, so that concurrent copies
+    // reuse each other's memory instead of faulting in fresh pages.
+    // Buffers come in power-of-two size classes.  Up to Capacity bytes
+    // of returned buffers are kept for reuse, and no more than Limit
+    // bytes are lent out at once: a lease that would go past it waits
+    // for others to end, unless nothing else is lent out.  A lease is
+    // granted in one piece, so copies waiting on each other can't
+    // deadlock holding half of what they need.
+    class BufferPool {
+        public:
+            static const size_t DEFAULT_CAPACITY = 64 * 1024 * 1024;
+            static const size_t DEFAULT_LIMIT = 1024 * 1024 * 1024;
+
+            struct Counters {
+                double hits;     // buffers handed out again
+                double misses;   // buffers that had to be allocated
+                double waits;    // leases that waited for the limit
+                double pooled;   // bytes kept for reuse
+                double lent;     // bytes lent out
+                double capacity;
+                double limit;
+            };
+
+            static BufferPool& Shared() {
+                static BufferPool pool;
+                return pool;
+            }
+
+            // count buffers of at least size bytes each
+            BufferLease Borrow(size_t size, size_t count = 1) {
+                BufferLease lease;
+
+                const int sizeClass = SizeClass(size);
+                const size_t bytes = (size_t) 1 << sizeClass;
+                const size_t total = bytes * count;
+
+                std::unique_lock<std::mutex> lock(mutex);
+
+                if (lent > 0 && lent + total > limit) {
+                    waits++;
+                    returned.wait(lock, [&] { return lent == 0 || lent + total <= limit; });
+                }
+
+                std::vector<char*>& spare = idle[sizeClass];
+                while (lease.buffers.size() < count && !spare.empty()) {
+                    lease.buffers.push_back(spare.back());
+                    spare.pop_back();
+                    pooled -= bytes;
+                    hits++;
+                }
+                lent += total;
+
+                // the rest are allocated without holding the lock
+                const size_t reused = lease.buffers.size();
+                lock.unlock();
+
+                lease.pool = this;
+                lease.size = bytes;
+                while (lease.buffers.size() < count) {
+                    char* buffer = Allocate(bytes);
+                    if (buffer == nullptr) {
+                        const size_t missing = count - lease.buffers.size();
+                        lease.Release();
+
+                        lock.lock();
+                        lent -= std::min(lent, missing * bytes);
+                        lock.unlock();
+                        returned.notify_all();
+                        return lease;
+                    }
+                    lease.buffers.push_back(buffer);
+                }
+
+                lock.lock();
+                misses += count - reused;
+                return lease;
+            }
+
+            void Configure(size_t newCapacity, size_t newLimit) {
+                std::lock_guard<std::mutex> lock(mutex);
+                capacity = newCapacity;
+                limit = newLimit;
+                Trim();
+                returned.notify_all();
+            }
+
+            Counters Stats() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return Counters{
+                    (double) hits, (double) misses, (double) waits,
+                    (double) pooled, (double) lent, (double) capacity, (double) limit
+                };
+            }
+
+        private:
+            friend class BufferLease;
+
+            // 64 KB up to 2 GB
+            static const int SMALLEST_CLASS = 16;
+            static const int CLASSES = 32;
+
+            std::mutex mutex;
+            std::condition_variable returned;
+
+            std::vector<char*> idle[CLASSES];
+            size_t pooled;
+            size_t lent;
+            size_t capacity;
+            size_t limit;
+
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t waits;
+
+            BufferPool()
+                : pooled(0), lent(0), capacity(DEFAULT_CAPACITY), limit(DEFAULT_LIMIT),
+                  hits(0), misses(0), waits(0) {}
+
+            static int SizeClass(size_t size) {
+                int sizeClass = SMALLEST_CLASS;
+                while (sizeClass < CLASSES - 1 && ((size_t) 1 << sizeClass) < size) sizeClass++;
+                return sizeClass;
+            }
+
+            // Page aligned, and backed by transparent huge pages where
+            // the buffer is big enough to use them.
+            static char* Allocate(size_t bytes) {
+#ifdef _WIN32
+                return (char*) VirtualAlloc(NULL, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+                void* memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+                if (bytes >= HUGE_PAGE_SIZE) madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+                return (char*) memory;
+#endif
+            }
+
+            static void Free(char* buffer, size_t bytes) {
+#ifdef _WIN32
+                VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+                munmap(buffer, bytes);
+#endif
+            }
+
+            static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+            void Return(std::vector<char*>& buffers, size_t bytes, bool reuse) {
+                std::vector<char*> surplus;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::vector<char*>& spare = idle[SizeClass(bytes)];
+                    for (char* buffer : buffers) {
+                        if (reuse && pooled + bytes <= capacity) {
+                            spare.push_back(buffer);
+                            pooled += bytes;
+                        }
+                        else if (reuse) {
+                            surplus.push_back(buffer);
+                        }
+                    }
+                    lent -= std::min(lent, bytes * buffers.size());
+                }
+                returned.notify_all();
+
+                for (char* buffer : surplus) Free(buffer, bytes);
+            }
+
+            // Frees the biggest buffers first until the pool fits its
+            // capacity.  Called with the mutex held.
+            void Trim() {
+                for (int sizeClass = CLASSES - 1; sizeClass >= 0 && pooled > capacity; sizeClass--) {
+                    const size_t bytes = (size_t) 1 << sizeClass;
+                    while (!idle[sizeClass].empty() && pooled > capacity) {
+                        Free(idle[sizeClass].back(), bytes);
+                        idle[sizeClass].pop_back();
+                        pooled -= bytes;
+                    }
+                }
+            }
+    };
+
+    void BufferLease::Release() {
+        if (pool != nullptr) pool->Return(buffers, size, /* reuse: */ true);
+        pool = nullptr;
+        buffers.clear();
+    }
+
+    void BufferLease::Abandon() {
+        if (pool != nullptr) pool->Return(buffers, size, /* reuse: */ false);
+        pool = nullptr;
+        buffers.clear();
+    }
+
+    // Limits for chunkSize: "auto".  Large enough for NVMe and network
+    // filesystems to stay busy, small enough to keep memory in check
+    // when many copies run at once.
+    const size_t AUTO_MIN_CHUNK_SIZE = 64 * 1024;
+    const size_t AUTO_MAX_CHUNK_SIZE = 8 * 1024 * 1024;
+
+    // Picks the buffer size for the buffered loop.  In auto mode it
+    // starts from the filesystem's preferred block size and keeps
+    // doubling the chunk for as long as doing so makes the copy faster.
+    class ChunkSizer {
+        public:
+            ChunkSizer(size_t requested, const struct stat& st)
+                : adaptive(requested == 0), bytes(0), best(0),
+                  started(std::chrono::steady_clock::now())
+            {
+                if (!adaptive) {
+                    size = capacity = requested;
+                    return;
+                }
+
+                size_t blockSize = AUTO_MIN_CHUNK_SIZE;
+#ifndef _WIN32
+                if (st.st_blksize > 0 && (size_t) st.st_blksize > blockSize) {
+                    blockSize = st.st_blksize;
+                }
+#endif
+
+                // no point in a buffer larger than the whole file
+                const size_t fileSize = st.st_size > 0 ? (size_t) st.st_size : 0;
+                const size_t wanted = (fileSize + blockSize - 1) / blockSize * blockSize;
+
+                capacity = std::max(blockSize, std::min(AUTO_MAX_CHUNK_SIZE, wanted));
+                size = std::min(blockSize, capacity);
+                adaptive = size < capacity;
+            }
+
+            size_t Size() const { return size; }
+            size_t Capacity() const { return capacity; }
+
+            // Called after every chunk with the bytes it moved
+            void Record(size_t moved) {
+                if (!adaptive) return;
+
+                bytes += moved;
+                if (bytes < size * SAMPLE_CHUNKS) return;
+
+                const auto now = std::chrono::steady_clock::now();
+                const double elapsed =
+                    std::chrono::duration<double>(now - started).count();
+                const double throughput = elapsed > 0 ? bytes / elapsed : 0;
+
+                // settle on the current size once doubling stops paying off
+                if (throughput > best * 1.1 && size < capacity) {
+                    best = throughput;
+                    size = std::min(size * 2, capacity);
+                }
+                else {
+                    adaptive = false;
+                }
+
+                bytes = 0;
+                started = now;
+            }
+
+        private:
+            // chunks that make up one throughput sample
+            static const size_t SAMPLE_CHUNKS = 8;
+
+            bool adaptive;
+            size_t size;
+            size_t capacity;
+
+            size_t bytes;
+            double best;
+            std::chrono::steady_clock::time_point started;
+    };
+
+    int BufferedCopy(int fd_in, int fd_out, const Job& job, const struct stat& st, ProgressTracker& tracker) {
+        ChunkSizer sizer(job.ChunkSize, st);
+
+        // borrowed up front at the largest size the sizer may pick
+        BufferLease buffer = BufferPool::Shared().Borrow(sizer.Capacity());
+        if (!buffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        ssize_t bytes_read = 0;
+
+        while ((bytes_read = doRead(fd_in, buffer.get(), sizer.Size())) > 0)
+        {
+            if (doWrite(fd_out, buffer.get(), bytes_read) == -1) return -1;
+
+            if (tracker.Add(buffer.get(), bytes_read) == -1) return -1;
+            sizer.Record(bytes_read);
+        }
+
+        return bytes_read == -1 ? -1 : 0;
+    }
+
+    // Chunk size for the pipeline in auto mode; there are several of
+    // these in flight, so stay well below AUTO_MAX_CHUNK_SIZE.
+    const size_t PIPELINE_CHUNK_SIZE = 1024 * 1024;
+
+    // A reader thread fills a ring of buffers while the calling thread
+    // drains it into the destination, so that neither device sits idle
+    // while the other is busy.
+    class BufferRing {
+        public:
+            BufferRing(int depth, size_t chunkSize)
+                : chunkSize(chunkSize), memory(BufferPool::Shared().Borrow(chunkSize, depth)),
+                  filled(0), head(0), tail(0), eof(false), aborted(false), readError(0)
+            {
+                for (size_t i = 0; i < memory.Count(); i++) {
+                    slots.push_back(Slot{ memory[i], 0 });
+                }
+            }
+
+            int Run(int fd_in, int fd_out, ProgressTracker& tracker) {
+                if (slots.size() < 2) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+
+                std::thread reader(&BufferRing::Read, this, fd_in);
+                int result = Write(fd_out, tracker);
+                int error = errno;
+
+                if (result == -1) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    aborted = true;
+                }
+                changed.notify_all();
+                reader.join();
+
+                if (result == 0 && readError != 0) {
+                    error = readError;
+                    result = -1;
+                }
+
+                errno = error;
+                return result;
+            }
+
+        private:
+            struct Slot {
+                char* data;
+                ssize_t length;
+            };
+
+            const size_t chunkSize;
+            BufferLease memory;
+            std::vector<Slot> slots;
+
+            std::mutex mutex;
+            std::condition_variable changed;
+
+            size_t filled; // slots holding data not yet written
+            size_t head;   // next slot for the reader
+            size_t tail;   // next slot for the writer
+
+            bool eof;
+            bool aborted;
+            int readError;
+
+            void Read(int fd_in) {
+                for (;;) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [this] {
+                            return aborted || filled < slots.size();
+                        });
+                        if (aborted) return;
+                    }
+
+                    // only the reader touches the slot at head until it
+                    // is marked as filled
+                    Slot& slot = slots[head];
+                    slot.length = doRead(fd_in, slot.data, chunkSize);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (slot.length <= 0) {
+                        if (slot.length == -1) readError = errno;
+                        eof = true;
+                        changed.notify_all();
+                        return;
+                    }
+
+                    head = (head + 1) % slots.size();
+                    filled++;
+                    changed.notify_all();
+                }
+            }
+
+            int Write(int fd_out, ProgressTracker& tracker) {
+                for (;;) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [this] {
+                            return eof || filled > 0;
+                        });
+                        if (filled == 0) return 0;
+                    }
+
+                    Slot& slot = slots[tail];
+                    if (doWrite(fd_out, slot.data, slot.length) == -1) return -1;
+                    if (tracker.Add(slot.data, slot.length) == -1) return -1;
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    tail = (tail + 1) % slots.size();
+                    filled--;
+                    changed.notify_all();
+                }
+            }
+    };
+
+    // Number of pipeline buffers to use for this copy, or 0 to use the
+    // plain buffered loop.  In auto mode reads and writes only overlap
+    // usefully when they hit different devices.
+    int PipelineDepth(int fd_out, const Job& job, const struct stat& st) {
+        if (job.Pipeline != PIPELINE_AUTO) return job.Pipeline;
+
+        struct stat out_stats;
+        if (fstat(fd_out, &out_stats) != 0) return 0;
+
+        return st.st_dev != out_stats.st_dev ? DEFAULT_PIPELINE_DEPTH : 0;
+    }
+
+    int PipelinedCopy(int fd_in, int fd_out, const Job& job, const struct stat& st,
+                      int depth, ProgressTracker& tracker) {
+        ChunkSizer sizer(job.ChunkSize, st);
+        size_t chunkSize = job.ChunkSize != 0
+            ? sizer.Capacity()
+            : std::min(sizer.Capacity(), PIPELINE_CHUNK_SIZE);
+
+        BufferRing ring(depth, chunkSize);
+        return ring.Run(fd_in, fd_out, tracker);
+    }
+
+    // errno values meaning "this engine can't handle these files", as
+    // opposed to a genuine I/O error.  The next engine gets a go.
+    bool Unsupported(int error) {
+        return error == ENOSYS || error == EXDEV || error == EINVAL ||
+               error == EOPNOTSUPP || error == ENOTSUP || error == ENOTTY ||
+               error == EBADF;
+    }
+
+#ifdef __linux__
+    // Per-call limit for the in-kernel engines, so progress still
+    // gets reported while a large file is being copied.
+    const size_t KERNEL_CHUNK_SIZE = 8 * 1024 * 1024;
+
+    int Reflink(int fd_in, int fd_out) {
+#ifdef FICLONE
+        return ioctl(fd_out, FICLONE, fd_in);
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+
+    ssize_t copyFileRange(int fd_in, int fd_out, size_t len) {
+#ifdef __NR_copy_file_range
+        return syscall(__NR_copy_file_range, fd_in, NULL, fd_out, NULL, len, 0);
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+
+    // Drives copy_file_range or sendfile until EOF.  Both advance the
+    // file offsets, so on failure the next engine can pick up from
+    // wherever this one stopped.
+    int KernelCopy(int fd_in, int fd_out, ProgressTracker& tracker, Engine engine) {
+        ssize_t copied;
+
+        for (;;) {
+            if (engine == ENGINE_COPY_FILE_RANGE) {
+                copied = copyFileRange(fd_in, fd_out, KERNEL_CHUNK_SIZE);
+            }
+            else {
+                copied = sendfile(fd_out, fd_in, NULL, KERNEL_CHUNK_SIZE);
+            }
+
+            if (copied == -1 && errno == EINTR) continue;
+            if (copied <= 0) break;
+
+            if (tracker.Add(copied) == -1) return -1;
+        }
+
+        return copied == -1 ? -1 : 0;
+    }
+#endif
+
+#ifdef NATIVEFS_HAVE_IO_URING
+    // Just enough of an io_uring driver for the copy engine, built on
+    // the raw syscalls so there is no dependency on liburing.
+    class Uring {
+        public:
+            Uring() : fd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED) {}
+
+            ~Uring() {
+                if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+                if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqSize);
+                if (sqRing != MAP_FAILED) munmap(sqRing, sqSize);
+                if (fd >= 0) close(fd);
+            }
+
+            int Setup(unsigned entries) {
+                struct io_uring_params params;
+                memset(&params, 0, sizeof(params));
+
+                fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+                if (fd < 0) return -1;
+
+                sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+                sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+                bool singleMap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+                singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+                if (singleMap) sqSize = cqSize = std::max(sqSize, cqSize);
+#endif
+
+                sqRing = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+                if (sqRing == MAP_FAILED) return -1;
+
+                cqRing = singleMap ? sqRing : mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                if (cqRing == MAP_FAILED) return -1;
+
+                sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+                if (sqes == MAP_FAILED) return -1;
+
+                char* sq = (char*) sqRing;
+                sqHead  = (unsigned*) (sq + params.sq_off.head);
+                sqTail  = (unsigned*) (sq + params.sq_off.tail);
+                sqMask  = *(unsigned*) (sq + params.sq_off.ring_mask);
+                sqArray = (unsigned*) (sq + params.sq_off.array);
+                sqEntries = params.sq_entries;
+
+                char* cq = (char*) cqRing;
+                cqHead = (unsigned*) (cq + params.cq_off.head);
+                cqTail = (unsigned*) (cq + params.cq_off.tail);
+                cqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+                cqes   = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+                tail = *sqTail;
+                pending = 0;
+                return 0;
+            }
+
+            int Register(unsigned opcode, void* arg, unsigned count) {
+                return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+            }
+
+            // A zeroed submission entry, or nullptr if the queue is full
+            struct io_uring_sqe* Next() {
+                if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+                    return nullptr;
+                }
+
+                const unsigned index = tail & sqMask;
+                struct io_uring_sqe* sqe = (struct io_uring_sqe*) sqes + index;
+                memset(sqe, 0, sizeof(*sqe));
+
+                sqArray[index] = index;
+                tail++;
+                pending++;
+                return sqe;
+            }
+
+            // Submits whatever has been queued, then blocks until at
+            // least `wait` completions are available.
+            int Submit(unsigned wait) {
+                __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+                for (;;) {
+                    int submitted = (int) syscall(__NR_io_uring_enter, fd, pending, wait,
+                                                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+                    if (submitted >= 0) {
+                        pending -= submitted;
+                        return 0;
+                    }
+                    if (errno != EINTR) return -1;
+                }
+            }
+
+            bool Reap(struct io_uring_cqe& cqe) {
+                const unsigned head = *cqHead;
+                if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+
+                cqe = cqes[head & cqMask];
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+
+        private:
+            int fd;
+
+            void* sqRing;
+            void* cqRing;
+            void* sqes;
+            size_t sqSize, cqSize, sqesSize;
+
+            unsigned *sqHead, *sqTail, *sqArray;
+            unsigned sqMask, sqEntries;
+
+            unsigned *cqHead, *cqTail;
+            unsigned cqMask;
+            struct io_uring_cqe* cqes;
+
+            unsigned tail;    // local copy of the submission tail
+            unsigned pending; // queued but not yet submitted
+    };
+
+    // Keeps up to QueueDepth chunks of the file in flight at once,
+    // each one a read linked to the write of the same range.  Buffers
+    // and both descriptors are registered with the kernel when it lets
+    // us, which saves it from mapping them on every request.
+    class UringCopier {
+        public:
+            UringCopier(int fd_in, int fd_out, ProgressTracker& tracker)
+                : fd_in(fd_in), fd_out(fd_out), tracker(tracker),
+                  fixedFiles(false), fixedBuffers(false),
+                  next(0), end(0), truncatedAt(-1), active(0), error(0), started(false) {}
+
+            int Run(const Job& job, const struct stat& st) {
+                // Zero-sized files may still have contents (/proc), and
+                // this engine only copies the size it was told about.
+                if (st.st_size <= 0) {
+                    errno = ENOTSUP;
+                    return -1;
+                }
+
+                end = st.st_size;
+
+                ChunkSizer sizer(job.ChunkSize, st);
+                chunkSize = job.ChunkSize != 0
+                    ? sizer.Capacity()
+                    : std::min(sizer.Capacity(), PIPELINE_CHUNK_SIZE);
+
+                const size_t depth = std::min(
+                    (size_t) job.QueueDepth, (size_t) ((end + chunkSize - 1) / chunkSize)
+                );
+
+                // every chunk needs two entries, one read and one write
+                if (ring.Setup((unsigned) depth * 2) == -1) {
+                    errno = ENOTSUP;
+                    return -1;
+                }
+
+                memory = BufferPool::Shared().Borrow(chunkSize, depth);
+                if (!memory) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+
+                slots.resize(depth);
+                std::vector<struct iovec> iovecs(depth);
+                for (size_t i = 0; i < depth; i++) {
+                    slots[i].buffer = memory[i];
+                    slots[i].iov.iov_base = memory[i];
+                    slots[i].iov.iov_len = chunkSize;
+                    iovecs[i] = slots[i].iov;
+                }
+
+                // both are optimisations; failures (e.g. RLIMIT_MEMLOCK)
+                // just mean the plain variants get used
+                fixedBuffers = ring.Register(IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned) depth) == 0;
+
+                int fds[2] = { fd_in, fd_out };
+                fixedFiles = ring.Register(IORING_REGISTER_FILES, fds, 2) == 0;
+
+                for (size_t i = 0; i < slots.size() && next < end; i++) {
+                    Start(i);
+                }
+
+                while (active > 0) {
+                    if (ring.Submit(1) == -1) {
+                        // There's no telling which requests the kernel
+                        // still holds, so leak the buffers rather than
+                        // free them underneath it.
+                        memory.Abandon();
+                        return -1;
+                    }
+
+                    struct io_uring_cqe cqe;
+                    while (ring.Reap(cqe)) Complete(cqe);
+                }
+
+                if (error != 0) {
+                    // the kernel rejected the operations themselves
+                    // before anything was written; let another engine
+                    // have a go
+                    errno = !started && Unsupported(error) ? ENOTSUP : error;
+                    return -1;
+                }
+
+                // the source shrank while it was being copied
+                if (truncatedAt >= 0 && ftruncate(fd_out, truncatedAt) == -1) return -1;
+
+                return 0;
+            }
+
+        private:
+            enum { READ, WRITE };
+
+            struct Slot {
+                char* buffer;
+                struct iovec iov;
+                off_t offset;    // start of the range this slot covers
+                size_t length;   // size of the range
+                size_t done;     // bytes of the range already written
+                size_t held;     // bytes read into buffer after a short read
+                size_t flushed;  // bytes of those already written
+                ssize_t results[2];
+                int outstanding; // requests not yet completed
+            };
+
+            const int fd_in, fd_out;
+            ProgressTracker& tracker;
+
+            // outlives the ring, which may have the buffers registered
+            BufferLease memory;
+            Uring ring;
+            std::vector<Slot> slots;
+            size_t chunkSize;
+
+            bool fixedFiles;
+            bool fixedBuffers;
+
+            off_t next;         // first byte not yet handed to a slot
+            off_t end;
+            off_t truncatedAt;  // where the source ended early, if it did
+            size_t active;      // slots with requests in flight
+            int error;
+            bool started;       // whether anything has been written
+
+            void Start(size_t index) {
+                Slot& slot = slots[index];
+                slot.offset = next;
+                slot.length = (size_t) std::min((off_t) chunkSize, end - next);
+                slot.done = 0;
+                slot.held = slot.flushed = 0;
+                next += slot.length;
+
+                active++;
+                Queue(index);
+            }
+
+            // (Re)submits the part of the slot's range not yet written
+            void Queue(size_t index) {
+                Slot& slot = slots[index];
+                const size_t remaining = slot.length - slot.done;
+                const off_t offset = slot.offset + slot.done;
+
+                slot.outstanding = 2;
+                slot.results[READ] = slot.results[WRITE] = 0;
+
+                // the ring has two entries per slot, so these never fail
+                struct io_uring_sqe* read = ring.Next();
+                struct io_uring_sqe* write = ring.Next();
+
+                Prepare(read, READ, index, fixedFiles ? 0 : fd_in, offset, remaining);
+                read->flags |= IOSQE_IO_LINK;
+                Prepare(write, WRITE, index, fixedFiles ? 1 : fd_out, offset, remaining);
+            }
+
+            // Submits a write on its own for what a short read left in
+            // the buffer; the write linked to that read was cancelled
+            void QueueHeld(size_t index) {
+                Slot& slot = slots[index];
+
+                slot.outstanding = 1;
+                slot.results[READ] = slot.results[WRITE] = 0;
+
+                struct io_uring_sqe* write = ring.Next();
+                Prepare(write, WRITE, index, fixedFiles ? 1 : fd_out, slot.offset + slot.done,
+                        slot.held - slot.flushed, slot.flushed);
+            }
+
+            // skip is where in the slot's buffer the data starts
+            void Prepare(struct io_uring_sqe* sqe, int direction, size_t index,
+                         int fd, off_t offset, size_t length, size_t skip = 0) {
+                Slot& slot = slots[index];
+
+                if (fixedBuffers) {
+                    sqe->opcode = direction == READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                    sqe->addr = (unsigned long) (slot.buffer + skip);
+                    sqe->len = (unsigned) length;
+                    sqe->buf_index = (unsigned short) index;
+                }
+                else {
+                    slot.iov.iov_base = slot.buffer + skip;
+                    slot.iov.iov_len = length;
+                    sqe->opcode = direction == READ ? IORING_OP_READV : IORING_OP_WRITEV;
+                    sqe->addr = (unsigned long) &slot.iov;
+                    sqe->len = 1;
+                }
+
+                sqe->fd = fd;
+                sqe->off = (unsigned long long) offset;
+                sqe->user_data = index * 2 + direction;
+                if (fixedFiles) sqe->flags |= IOSQE_FIXED_FILE;
+            }
+
+            void Complete(const struct io_uring_cqe& cqe) {
+                const size_t index = (size_t) (cqe.user_data / 2);
+                const int direction = (int) (cqe.user_data % 2);
+                Slot& slot = slots[index];
+
+                slot.results[direction] = cqe.res;
+                if (--slot.outstanding > 0) return;
+
+                if (slot.held > 0) {
+                    CompleteHeld(index);
+                    return;
+                }
+
+                // Both halves are in.  A short read cancels the linked
+                // write, so what it did read is written on its own;
+                // only bytes that were both read and written count as
+                // done.
+                const ssize_t readResult = slot.results[READ];
+                const ssize_t writeResult = slot.results[WRITE];
+
+                if (readResult < 0 && readResult != -ECANCELED) {
+                    Fail((int) -readResult);
+                }
+                else if (writeResult < 0 && writeResult != -ECANCELED) {
+                    Fail((int) -writeResult);
+                }
+
+                if (error == 0) {
+                    if (readResult > 0 && writeResult == -ECANCELED) {
+                        slot.held = (size_t) readResult;
+                        slot.flushed = 0;
+                        QueueHeld(index);
+                        return;
+                    }
+
+                    const ssize_t copied = std::max((ssize_t) 0, std::min(readResult, writeResult));
+                    if (copied > 0 && Count(index, copied) == -1) return;
+
+                    if (readResult == 0) {
+                        // end of file came early
+                        EndAt(slot.offset + slot.done);
+                    }
+                    else if (slot.done < slot.length) {
+                        Queue(index);
+                        return;
+                    }
+
+                    if (next < end) {
+                        active--;
+                        Start(index);
+                        return;
+                    }
+                }
+
+                active--;
+            }
+
+            // A write of held bytes is in
+            void CompleteHeld(size_t index) {
+                Slot& slot = slots[index];
+                const ssize_t written = slot.results[WRITE];
+
+                if (written < 0) Fail((int) -written);
+                else if (written == 0) Fail(EIO);
+
+                if (error == 0) {
+                    slot.flushed += (size_t) written;
+                    if (Count(index, written) == -1) return;
+
+                    if (slot.flushed < slot.held) {
+                        QueueHeld(index);
+                        return;
+                    }
+                    slot.held = slot.flushed = 0;
+
+                    // the read came up short, so the rest of the range
+                    // is read again, which finds the end if it is there
+                    if (slot.done < slot.length) {
+                        Queue(index);
+                        return;
+                    }
+                    if (next < end) {
+                        active--;
+                        Start(index);
+                        return;
+                    }
+                }
+
+                active--;
+            }
+
+            // Counts bytes of the slot's range as written.  Returns 0, or
+            // -1 having retired the slot if the copy has to stop.
+            int Count(size_t index, ssize_t bytes) {
+                started = true;
+                slots[index].done += bytes;
+                if (tracker.Add(bytes) == -1) {
+                    Fail(errno);
+                    active--;
+                    return -1;
+                }
+                return 0;
+            }
+
+            void EndAt(off_t eof) {
+                truncatedAt = truncatedAt < 0 ? eof : std::min(truncatedAt, eof);
+                end = std::min(end, truncatedAt);
+            }
+
+            void Fail(int code) {
+                if (error == 0) error = code;
+                next = end; // stop handing out new ranges
+            }
+    };
+
+    int UringCopy(int fd_in, int fd_out, const Job& job, const struct stat& st, ProgressTracker& tracker) {
+        UringCopier copier(fd_in, fd_out, tracker);
+        return copier.Run(job, st);
+    }
+#endif
+
+    // Finds the first allocated extent of fd at or after offset.
+    // Returns 0 and sets [start, end) if there is one, 1 if the rest of
+    // the file is a hole, and -1 with errno set if the filesystem can't
+    // tell.
+    int NextExtent(int fd, int64_t offset, int64_t size, int64_t& start, int64_t& end) {
+#if defined(_WIN32)
+        HANDLE h = (HANDLE) _get_osfhandle(fd);
+
+        FILE_ALLOCATED_RANGE_BUFFER query, range;
+        query.FileOffset.QuadPart = offset;
+        query.Length.QuadPart = size - offset;
+
+        DWORD returned = 0;
+        if (!DeviceIoControl(h, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+                             &range, sizeof(range), &returned, NULL) &&
+            GetLastError() != ERROR_MORE_DATA) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        if (returned < sizeof(range)) return 1;
+
+        start = std::max(offset, (int64_t) range.FileOffset.QuadPart);
+        end = std::min(size, (int64_t) (range.FileOffset.QuadPart + range.Length.QuadPart));
+        return 0;
+#elif defined(SEEK_DATA) && defined(SEEK_HOLE)
+        off_t data = lseek(fd, (off_t) offset, SEEK_DATA);
+        if (data == -1) return errno == ENXIO ? 1 : -1;
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) return -1;
+
+        start = data;
+        end = std::min(size, (int64_t) hole);
+        return 0;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+
+    // Whether a source is worth copying extent by extent in auto mode
+    bool LooksSparse(int fd, const struct stat& st) {
+#ifdef _WIN32
+        BY_HANDLE_FILE_INFORMATION info;
+        HANDLE h = (HANDLE) _get_osfhandle(fd);
+        return GetFileInformationByHandle(h, &info) &&
+               (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+#else
+        return (int64_t) st.st_blocks * 512 < (int64_t) st.st_size;
+#endif
+    }
+
+    // Copies [start, end) of fd_in to the same place in fd_out
+    int CopyExtent(int fd_in, int fd_out, int64_t start, int64_t end,
+                   char* buffer, size_t bufferSize, ProgressTracker& tracker) {
+#ifdef __linux__
+        loff_t in_offset = start, out_offset = start;
+        while (in_offset < end && !tracker.Hashing()) {
+#ifdef __NR_copy_file_range
+            ssize_t copied = syscall(__NR_copy_file_range, fd_in, &in_offset, fd_out, &out_offset,
+                                     (size_t) std::min((int64_t) KERNEL_CHUNK_SIZE, end - in_offset), 0);
+#else
+            ssize_t copied = -1;
+            errno = ENOSYS;
+#endif
+            if (copied == -1 && errno == EINTR) continue;
+            if (copied == -1 && Unsupported(errno)) break;
+            if (copied == -1) return -1;
+            if (copied == 0) return 0; // the source shrank
+
+            if (tracker.Add(copied) == -1) return -1;
+        }
+        start = in_offset;
+        if (start >= end) return 0;
+#endif
+
+        if (lseek(fd_in, start, SEEK_SET) == -1 || lseek(fd_out, start, SEEK_SET) == -1) {
+            return -1;
+        }
+
+        while (start < end) {
+            ssize_t bytes_read = doRead(fd_in, buffer, std::min((int64_t) bufferSize, end - start));
+            if (bytes_read == -1) return -1;
+            if (bytes_read == 0) return 0;
+
+            if (doWrite(fd_out, buffer, bytes_read) == -1) return -1;
+
+            if (tracker.Add(buffer, bytes_read) == -1) return -1;
+            start += bytes_read;
+        }
+        return 0;
+    }
+
+    // Copies only the allocated extents of the source and leaves holes
+    // where it has them.  Holes still count towards progress, which is
+    // in logical bytes like for every other engine.
+    int SparseCopy(int fd_in, int fd_out, const Job& job, const struct stat& st, ProgressTracker& tracker) {
+        const int64_t size = st.st_size;
+
+        int64_t start, end;
+        int found = NextExtent(fd_in, 0, size, start, end);
+        if (found == -1) {
+            if (Unsupported(errno)) errno = ENOTSUP;
+            return -1;
+        }
+
+#ifdef _WIN32
+        // without this NTFS fills the skipped ranges with zeros
+        DWORD returned;
+        DeviceIoControl((HANDLE) _get_osfhandle(fd_out), FSCTL_SET_SPARSE,
+                        NULL, 0, NULL, 0, &returned, NULL);
+#endif
+
+        ChunkSizer sizer(job.ChunkSize, st);
+        const size_t bufferSize = std::min(sizer.Capacity(), PIPELINE_CHUNK_SIZE);
+        BufferLease buffer = BufferPool::Shared().Borrow(bufferSize);
+        if (!buffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        int64_t position = 0;
+        while (found == 0) {
+            // the hole before it
+            if (tracker.AddHole(start - position) == -1) return -1;
+
+            if (CopyExtent(fd_in, fd_out, start, end, buffer.get(), bufferSize, tracker) == -1) {
+                return -1;
+            }
+
+            position = end;
+            if (position >= size) break;
+
+            found = NextExtent(fd_in, position, size, start, end);
+            if (found == -1) return -1;
+        }
+
+        // recreates the trailing hole, and sets the size if there was none
+#ifdef _WIN32
+        if (_chsize_s(fd_out, size) != 0) return -1;
+#else
+        if (ftruncate(fd_out, (off_t) size) == -1) return -1;
+#endif
+        return tracker.AddHole(size - position);
+    }
+
+    // Reserves size bytes for fd_out without changing its size, so the
+    // filesystem can lay the file out in one go and a full disk shows
+    // up before any data has been written.  Returns -1 with errno set
+    // to ENOSPC in that case; every other failure is ignored, since the
+    // copy works just as well without.
+    int Preallocate(int fd_out, int64_t size) {
+#if defined(_WIN32)
+        FILE_ALLOCATION_INFO info;
+        info.AllocationSize.QuadPart = size;
+        if (!SetFileInformationByHandle((HANDLE) _get_osfhandle(fd_out), FileAllocationInfo,
+                                        &info, sizeof(info)) &&
+            GetLastError() == ERROR_DISK_FULL) {
+            errno = ENOSPC;
+            return -1;
+        }
+#elif defined(__linux__)
+        int result;
+        do {
+            result = fallocate(fd_out, FALLOC_FL_KEEP_SIZE, 0, (off_t) size);
+        } while (result == -1 && errno == EINTR);
+
+        if (result == -1 && errno == ENOSPC) return -1;
+#elif defined(__APPLE__)
+        fstore_t store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t) size, 0 };
+        if (fcntl(fd_out, F_PREALLOCATE, &store) == -1) {
+            // a contiguous run isn't essential
+            store.fst_flags = F_ALLOCATEALL;
+            if (fcntl(fd_out, F_PREALLOCATE, &store) == -1 && errno == ENOSPC) return -1;
+        }
+#endif
+        return 0;
+    }
+
+    // Alignment that satisfies O_DIRECT and FILE_FLAG_NO_BUFFERING on
+    // every sector size in use today
+    const size_t DIRECT_ALIGNMENT = 4096;
+
+    // Copies with the page cache out of the way, for cacheMode
+    // "direct".  Returns ENOTSUP, so the caller falls back to the other
+    // engines (with CacheDropper evicting as they go), where the
+    // filesystem doesn't do direct I/O.
+    int DirectCopy(int fd_in, int fd_out, const Job& job, const struct stat& st, ProgressTracker& tracker) {
+        ChunkSizer sizer(job.ChunkSize, st);
+        const size_t chunkSize = std::max(DIRECT_ALIGNMENT,
+            std::min(sizer.Capacity(), PIPELINE_CHUNK_SIZE) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT);
+
+        // pool buffers are page aligned
+        BufferLease buffer = BufferPool::Shared().Borrow(chunkSize);
+        if (!buffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+#if defined(O_DIRECT)
+        const int in_flags = fcntl(fd_in, F_GETFL);
+        const int out_flags = fcntl(fd_out, F_GETFL);
+        if (in_flags == -1 || out_flags == -1 ||
+            fcntl(fd_in, F_SETFL, in_flags | O_DIRECT) == -1) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        if (fcntl(fd_out, F_SETFL, out_flags | O_DIRECT) == -1) {
+            fcntl(fd_in, F_SETFL, in_flags);
+            errno = ENOTSUP;
+            return -1;
+        }
+
+        bool started = false;
+        ssize_t bytes_read;
+
+        while ((bytes_read = doRead(fd_in, buffer.get(), chunkSize)) > 0) {
+            // The tail of the file isn't a whole number of blocks, and
+            // neither is what's left after a short write, so those go
+            // through the cache.
+            if (bytes_read % DIRECT_ALIGNMENT != 0) {
+                fcntl(fd_out, F_SETFL, out_flags);
+            }
+
+            int64_t done = 0;
+            int64_t written = doWrite(fd_out, buffer.get(), bytes_read, &done);
+            if (written == -1 && errno == EINVAL) {
+                fcntl(fd_out, F_SETFL, out_flags);
+                written = doWrite(fd_out, buffer.get() + done, bytes_read - done);
+            }
+            if (written == -1) return -1;
+
+            started = true;
+            if (tracker.Add(buffer.get(), bytes_read) == -1) {
+                bytes_read = -1;
+                break;
+            }
+        }
+
+        fcntl(fd_in, F_SETFL, in_flags);
+        fcntl(fd_out, F_SETFL, out_flags);
+
+        if (bytes_read == -1) {
+            // the first read is where a filesystem without direct I/O
+            // (tmpfs, some FUSE mounts) objects
+            if (!started && errno == EINVAL) errno = ENOTSUP;
+            return -1;
+        }
+        return 0;
+#elif defined(_WIN32)
+        // Unbuffered I/O can only be asked for when a handle is opened,
+        // so reads go through a second, unbuffered handle on the source.
+        // Writes stay buffered: NO_BUFFERING would need every write,
+        // including the last, to be a whole number of sectors.
+        HANDLE reopened = ReOpenFile((HANDLE) _get_osfhandle(fd_in), GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN);
+        if (reopened == INVALID_HANDLE_VALUE) {
+            errno = ENOTSUP;
+            return -1;
+        }
+
+        int result = 0;
+        for (;;) {
+            DWORD bytes_read = 0;
+            if (!ReadFile(reopened, buffer.get(), (DWORD) chunkSize, &bytes_read, NULL)) {
+                errno = EIO;
+                result = -1;
+                break;
+            }
+            if (bytes_read == 0) break;
+
+            if (doWrite(fd_out, buffer.get(), bytes_read) == -1) {
+                result = -1;
+                break;
+            }
+            if (tracker.Add(buffer.get(), bytes_read) == -1) {
+                result = -1;
+                break;
+            }
+        }
+
+        CloseHandle(reopened);
+        return result;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    }
+
+    // Source windows the mmap engine maps at a time, as large as the
+    // kernel engines' chunks so progress comes as often.  A multiple of
+    // the allocation granularity everywhere, which Windows requires of
+    // the offsets.
+    const size_t MMAP_WINDOW_SIZE = 8 * 1024 * 1024;
+
+    // Writes the destination straight out of windows mapped over the
+    // source, saving the copy into a buffer of our own.  Reading past
+    // the end of a mapped file faults, so the source's size is checked
+    // again before each window in case it shrank; a file truncated
+    // while a window is being written still raises SIGBUS, which takes
+    // the process down, so this only runs when asked for by name.
+    int MmapCopy(int fd_in, int fd_out, const struct stat& st, ProgressTracker& tracker) {
+        int64_t size = st.st_size;
+        if (size <= 0) {
+            errno = ENOTSUP;
+            return -1;
+        }
+
+#ifdef _WIN32
+        HANDLE mapping = CreateFileMappingA((HANDLE) _get_osfhandle(fd_in), NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            errno = ENOTSUP;
+            return -1;
+        }
+#endif
+
+        int result = 0;
+        for (int64_t offset = 0; offset < size; offset += MMAP_WINDOW_SIZE) {
+            struct stat now;
+            if (fstat(fd_in, &now) == 0 && now.st_size < size) {
+                size = now.st_size;
+                if (offset >= size) break;
+            }
+            const size_t length = (size_t) std::min((int64_t) MMAP_WINDOW_SIZE, size - offset);
+
+            // only a failure to map the first window means the file
+            // can't be mapped at all
+#ifdef _WIN32
+            char* window = (char*) MapViewOfFile(mapping, FILE_MAP_READ,
+                                                 (DWORD) (offset >> 32), (DWORD) offset, length);
+            if (window == NULL) {
+                errno = offset == 0 ? ENOTSUP : ErrnoFromWindows(GetLastError());
+                result = -1;
+                break;
+            }
+#else
+            void* mapped = mmap(NULL, length, PROT_READ, MAP_SHARED, fd_in, (off_t) offset);
+            if (mapped == MAP_FAILED) {
+                if (offset == 0) errno = ENOTSUP;
+                result = -1;
+                break;
+            }
+#ifdef MADV_SEQUENTIAL
+            madvise(mapped, length, MADV_SEQUENTIAL);
+#endif
+            char* window = (char*) mapped;
+#endif
+
+            // the reads are page faults
+            result = doWrite(fd_out, window, (int64_t) length) == -1 ? -1 : 0;
+            if (result != -1) result = tracker.Add(window, (int64_t) length, 0, 1);
+            const int error = errno;
+
+#ifdef _WIN32
+            UnmapViewOfFile(window);
+#else
+            munmap(window, length);
+#endif
+
+            if (result == -1) {
+                errno = error;
+                break;
+            }
+            result = 0;
+        }
+
+#ifdef _WIN32
+        CloseHandle(mapping);
+#endif
+        return result;
+    }
+
+#ifdef __APPLE__
+    // copyfile(3) on descriptors, which has the kernel's own idea of the
+    // best way to move the data.  There's no progress until it returns.
+    int FCopyFile(int fd_in, int fd_out, const struct stat& st, ProgressTracker& tracker) {
+        if (fcopyfile(fd_in, fd_out, NULL, COPYFILE_DATA) < 0) return -1;
+        return tracker.Add((int64_t) st.st_size);
+    }
+#endif
+
+    // Rewrites only the blocks of an existing destination that differ
+    // from the source, and cuts off whatever is left past its end.
+    // Comparing the blocks directly is exact and, with both files read
+    // anyway, cheaper than hashing them.
+    int IncrementalCopy(int fd_in, int fd_out, int64_t existing, ProgressTracker& tracker, Stats& stats) {
+        const size_t COMPARE_BLOCK_SIZE = 1024 * 1024;
+
+        BufferLease buffers = BufferPool::Shared().Borrow(COMPARE_BLOCK_SIZE, 2);
+        if (!buffers) {
+            errno = ENOMEM;
+            return -1;
+        }
+        char* const source = buffers[0];
+        char* const destination = buffers[1];
+
+        stats.written = 0;
+
+        int64_t position = 0;
+        for (;;) {
+            ssize_t bytes_read = doRead(fd_in, source, COMPARE_BLOCK_SIZE);
+            if (bytes_read == -1) return -1;
+            if (bytes_read == 0) break;
+
+            bool same = false;
+            if (position < existing) {
+                ssize_t have = 0;
+                while (have < bytes_read) {
+                    ssize_t got = doReadAt(fd_out, destination + have, bytes_read - have, position + have);
+                    if (got == -1) return -1;
+                    if (got == 0) break;
+                    have += got;
+                }
+                same = have == bytes_read && memcmp(source, destination, bytes_read) == 0;
+            }
+
+            if (!same) {
+                if (doWriteAt(fd_out, source, bytes_read, position) == -1) return -1;
+                stats.written += bytes_read;
+            }
+
+            const int reads = position < existing ? 2 : 1;
+            if (tracker.Add(source, bytes_read, reads, same ? 0 : 1) == -1) return -1;
+            position += bytes_read;
+        }
+
+        if (position < existing) {
+#ifdef _WIN32
+            if (_chsize_s(fd_out, position) != 0) return -1;
+#else
+            if (ftruncate(fd_out, (off_t) position) == -1) return -1;
+#endif
+        }
+        return 0;
+    }
+
+    // Resumable copies checkpoint this often, which is as much as an
+    // interruption can lose
+    const int64_t RESUME_INTERVAL = 64 * 1024 * 1024;
+
+    // The sidecar journal of a resumable copy, ".<name>.resume" next to
+    // the destination.  It says how much of the destination is known to
+    // be on disk, for which source (by size and modification time), and
+    // holds a CRC-32C of the block before that point, which both files
+    // have to match for a later copy to carry on from there.
+    class ResumeJournal {
+        public:
+            ResumeJournal(const std::string& destination, const struct stat& st)
+                : path(JournalName(destination)), size((int64_t) st.st_size),
+                  mtime((int64_t) st.st_mtime) {}
+
+            // Where an earlier copy of the same source to the same
+            // destination left off, or 0
+            int64_t Load(int fd_in, int fd_out) const {
+                char record[128] = { 0 };
+
+                int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+                if (fd < 0) return 0;
+                ssize_t length = read(fd, record, sizeof(record) - 1);
+                close(fd);
+                if (length <= 0) return 0;
+
+                long long recordSize, recordTime, offset;
+                char tail[17];
+                if (sscanf(record, "nativefs-resume 1 %lld %lld %lld %16s",
+                           &recordSize, &recordTime, &offset, tail) != 4 ||
+                    recordSize != size || recordTime != mtime || offset <= 0 || offset > size) {
+                    return 0;
+                }
+
+                struct stat existing;
+                if (fstat(fd_out, &existing) != 0 || existing.st_size < offset) return 0;
+
+                const std::string digest = Tail(fd_out, offset);
+                if (digest.empty() || digest != tail || Tail(fd_in, offset) != digest) return 0;
+                return offset;
+            }
+
+            // Records that the destination is on disk up to offset.
+            // Returns 0, or -1 with errno set.
+            int Save(int fd_out, int64_t offset) const {
+                const std::string digest = Tail(fd_out, offset);
+                if (digest.empty()) return -1;
+
+                char record[128];
+                int length = snprintf(record, sizeof(record), "nativefs-resume 1 %lld %lld %lld %s\n",
+                                      (long long) size, (long long) mtime, (long long) offset,
+                                      digest.c_str());
+
+                // short enough to be written in one go; a torn record
+                // just fails to parse, and the copy starts over
+                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+                if (fd < 0) return -1;
+                if (write(fd, record, length) != length) {
+                    int error = errno;
+                    close(fd);
+                    errno = error;
+                    return -1;
+                }
+                fsync(fd);
+                close(fd);
+                return 0;
+            }
+
+            void Remove() const {
+                remove(path.c_str());
+            }
+
+        private:
+            static const int64_t TAIL_SIZE = 64 * 1024;
+
+            const std::string path;
+            const int64_t size;
+            const int64_t mtime;
+
+            static std::string JournalName(const std::string& destination) {
+                const size_t slash = destination.find_last_of(PATH_SEPARATORS);
+                const std::string directory = slash == std::string::npos ? "" : destination.substr(0, slash + 1);
+                const std::string base = slash == std::string::npos ? destination : destination.substr(slash + 1);
+
+                return directory + "." + base + ".resume";
+            }
+
+            // CRC-32C of the TAIL_SIZE bytes before offset, empty if they
+            // can't be read.  Moves the file offset.
+            static std::string Tail(int fd, int64_t offset) {
+                std::vector<char> buffer(TAIL_SIZE);
+                const int64_t start = std::max((int64_t) 0, offset - TAIL_SIZE);
+                if (lseek(fd, start, SEEK_SET) == -1) return "";
+
+                ssize_t have = 0;
+                while (have < offset - start) {
+                    ssize_t got = read(fd, buffer.data() + have, (size_t) (offset - start - have));
+                    if (got == -1 && errno == EINTR) continue;
+                    if (got <= 0) return "";
+                    have += got;
+                }
+
+                std::unique_ptr<Hasher> hasher(Hasher::Create(CHECKSUM_CRC32C));
+                hasher->Update(buffer.data(), have);
+                return hasher->Digest();
+            }
+    };
+
+    // The engine for resumable copies.  Picks up where the journal says
+    // an earlier attempt stopped, then copies in RESUME_INTERVAL
+    // segments, syncing the destination and recording it in the journal
+    // after each one.  The data goes through copy_file_range where the
+    // kernel has it and nothing needs to see it, or a buffer.
+    int ResumableCopy(
+        int fd_in, int fd_out, const Job& job, const struct stat& st,
+        const ResumeJournal& journal, ProgressTracker& tracker, Stats& stats
+    ) {
+        int64_t size = st.st_size;
+        const size_t RESUME_CHUNK_SIZE = 1024 * 1024;
+
+        BufferLease buffer = BufferPool::Shared().Borrow(RESUME_CHUNK_SIZE);
+        if (!buffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        int64_t position = journal.Load(fd_in, fd_out);
+        stats.resumed = (double) position;
+
+        if (lseek(fd_in, 0, SEEK_SET) == -1) return -1;
+        if (position == 0) {
+#ifdef _WIN32
+            if (_chsize_s(fd_out, 0) != 0) return -1;
+#else
+            if (ftruncate(fd_out, 0) == -1) return -1;
+#endif
+            if (job.Preallocate && Preallocate(fd_out, size) == -1) return -1;
+        }
+        else if (tracker.Hashing()) {
+            // the checksum covers the whole file, so the part already
+            // copied is read again, though not written
+            for (int64_t done = 0; done < position; ) {
+                ssize_t bytes_read = doRead(fd_in, buffer.get(), std::min((int64_t) RESUME_CHUNK_SIZE, position - done));
+                if (bytes_read <= 0) return -1;
+                if (tracker.Add(buffer.get(), bytes_read, 1, 0) == -1) return -1;
+                done += bytes_read;
+            }
+        }
+        else {
+            if (tracker.Skip(position) == -1) return -1;
+        }
+
+        if (lseek(fd_in, position, SEEK_SET) == -1 || lseek(fd_out, position, SEEK_SET) == -1) return -1;
+
+        bool kernel = !tracker.Hashing();
+        while (position < size) {
+            const int64_t end = std::min(size, position + RESUME_INTERVAL);
+
+            while (position < end) {
+                const size_t chunk = (size_t) std::min((int64_t) RESUME_CHUNK_SIZE, end - position);
+                ssize_t copied = -1;
+#ifdef __linux__
+                if (kernel) {
+                    copied = copyFileRange(fd_in, fd_out, chunk);
+                    if (copied == -1 && errno == EINTR) continue;
+                    if (copied == -1 && Unsupported(errno)) kernel = false;
+                    else if (copied == -1) return -1;
+                    else if (tracker.Add(copied) == -1) return -1;
+                }
+#else
+                kernel = false;
+#endif
+                if (!kernel) {
+                    copied = doRead(fd_in, buffer.get(), chunk);
+                    if (copied == -1) return -1;
+                    if (copied > 0 && doWrite(fd_out, buffer.get(), copied) == -1) return -1;
+                    if (tracker.Add(buffer.get(), copied) == -1) return -1;
+                }
+
+                // the source has shrunk; what's there has been copied
+                if (copied == 0) {
+                    size = position;
+                    break;
+                }
+                position += copied;
+            }
+
+            if (position < size) {
+#if defined(_WIN32) || defined(__APPLE__)
+                fsync(fd_out);
+#else
+                if (fdatasync(fd_out) == -1) return -1;
+#endif
+                if (journal.Save(fd_out, position) == -1) return -1;
+                if (lseek(fd_out, position, SEEK_SET) == -1) return -1;
+            }
+        }
+
+        // an earlier attempt may have left more than the source has now
+        struct stat existing;
+        if (fstat(fd_out, &existing) == 0 && existing.st_size > position) {
+#ifdef _WIN32
+            if (_chsize_s(fd_out, position) != 0) return -1;
+#else
+            if (ftruncate(fd_out, (off_t) position) == -1) return -1;
+#endif
+        }
+        return 0;
+    }
+
+    // Runs work(0) to work(count - 1) side by side, work(0) on the
+    // calling thread, and waits for all of them.  Built without
+    // exceptions, a std::thread that can't be started aborts the
+    // process, so these are started by hand and the ones that did start
+    // get the work: it has to be handed out as they ask for it, not by
+    // index.  Returns how many ran.
+    class Threads {
+        public:
+            static size_t Run(size_t count, const std::function<void(size_t)>& work) {
+                std::vector<Start> starts(count);
+#ifdef _WIN32
+                std::vector<HANDLE> threads;
+#else
+                std::vector<pthread_t> threads;
+#endif
+                for (size_t i = 1; i < count; i++) {
+                    starts[i].work = &work;
+                    starts[i].index = i;
+#ifdef _WIN32
+                    HANDLE thread = CreateThread(NULL, 0, &Threads::Main, &starts[i], 0, NULL);
+                    if (thread == NULL) break;
+#else
+                    pthread_t thread;
+                    if (pthread_create(&thread, NULL, &Threads::Main, &starts[i]) != 0) break;
+#endif
+                    threads.push_back(thread);
+                }
+
+                work(0);
+
+                for (auto& thread : threads) {
+#ifdef _WIN32
+                    WaitForSingleObject(thread, INFINITE);
+                    CloseHandle(thread);
+#else
+                    pthread_join(thread, NULL);
+#endif
+                }
+                return threads.size() + 1;
+            }
+
+        private:
+            struct Start {
+                const std::function<void(size_t)>* work;
+                size_t index;
+            };
+
+#ifdef _WIN32
+            static DWORD WINAPI Main(LPVOID argument) {
+                const Start* start = (const Start*) argument;
+                (*start->work)(start->index);
+                return 0;
+            }
+#else
+            static void* Main(void* argument) {
+                const Start* start = (const Start*) argument;
+                (*start->work)(start->index);
+                return nullptr;
+            }
+#endif
+    };
+
+    // Input read, and fed to the compressor, at a time; large files are
+    // compressed a chunk per thread
+    const size_t TRANSFORM_CHUNK_SIZE = 4 * 1024 * 1024;
+
+    int ZlibErrno(int result) {
+        switch (result) {
+            case Z_MEM_ERROR:  return ENOMEM;
+            case Z_DATA_ERROR: return EINVAL; // not gzip, or corrupt
+            case Z_BUF_ERROR:  return EINVAL; // cut short
+            default:           return EIO;
+        }
+    }
+
+    // Compresses data into out as one complete gzip member.  Returns its
+    // size, or -1 with errno set.  With several members to a file,
+    // chunks can be compressed independently; gunzip reads them back as
+    // one stream.  Passing out as nullptr asks for the most it can take.
+    ssize_t GzipMember(const char* data, size_t size, char* out, size_t capacity, int level) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        int result = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        if (result != Z_OK) {
+            errno = ZlibErrno(result);
+            return -1;
+        }
+
+        if (out == nullptr) {
+            ssize_t bound = (ssize_t) deflateBound(&stream, (uLong) size);
+            deflateEnd(&stream);
+            return bound;
+        }
+
+        stream.next_in = (Bytef*) data;
+        stream.avail_in = (uInt) size;
+        stream.next_out = (Bytef*) out;
+        stream.avail_out = (uInt) capacity;
+        result = deflate(&stream, Z_FINISH);
+        deflateEnd(&stream);
+
+        if (result != Z_STREAM_END) {
+            errno = ZlibErrno(result);
+            return -1;
+        }
+        return (ssize_t) (capacity - stream.avail_out);
+    }
+
+    // The compress engine: job.CompressionThreads threads (or as many as
+    // there are cores) each read the next chunk in turn, compress it on
+    // their own, and wait for its turn to be written, so the members
+    // come out in order while the reading, compressing and writing of
+    // different chunks overlap.  The threads live as long as the copy.
+    int GzipCopy(int fd_in, int fd_out, const Job& job, const struct stat& st,
+                 ProgressTracker& tracker, Stats& stats) {
+        const int64_t chunks = std::max((int64_t) 1,
+            ((int64_t) st.st_size + (int64_t) TRANSFORM_CHUNK_SIZE - 1) / (int64_t) TRANSFORM_CHUNK_SIZE);
+        const size_t wanted = job.CompressionThreads > 0
+            ? (size_t) job.CompressionThreads
+            : std::max(1u, std::thread::hardware_concurrency());
+        const size_t threads = (size_t) std::min((int64_t) wanted, chunks);
+
+        const ssize_t bound = GzipMember(nullptr, TRANSFORM_CHUNK_SIZE, nullptr, 0, job.CompressionLevel);
+        if (bound == -1) return -1;
+
+        BufferLease input = BufferPool::Shared().Borrow(TRANSFORM_CHUNK_SIZE, threads);
+        BufferLease output = BufferPool::Shared().Borrow((size_t) bound, threads);
+        if (!input || !output) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        stats.written = 0;
+
+        // reading happens under the lock, in order, and so does writing,
+        // each chunk once the one before it is out
+        std::mutex mutex;
+        std::condition_variable written;
+        int64_t nextRead = 0, nextWrite = 0;
+        bool ended = false;
+        int failure = 0;
+
+        auto compressor = [&](size_t index) {
+            char* const in = input[index];
+            char* const out = output[index];
+
+            for (;;) {
+                int64_t sequence;
+                ssize_t have = 0;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (ended || failure != 0) return;
+
+                    while (have < (ssize_t) TRANSFORM_CHUNK_SIZE) {
+                        ssize_t got = doRead(fd_in, in + have, TRANSFORM_CHUNK_SIZE - have);
+                        if (got == -1) {
+                            failure = errno;
+                            written.notify_all();
+                            return;
+                        }
+                        if (got == 0) break;
+                        have += got;
+                    }
+                    if (have < (ssize_t) TRANSFORM_CHUNK_SIZE) ended = true;
+                    // an empty file still gets its (empty) member
+                    if (have == 0 && nextRead > 0) return;
+                    sequence = nextRead++;
+                }
+
+                const ssize_t compressed = GzipMember(in, have, out, (size_t) bound, job.CompressionLevel);
+                const int error = compressed == -1 ? errno : 0;
+
+                std::unique_lock<std::mutex> lock(mutex);
+                written.wait(lock, [&] { return nextWrite == sequence || failure != 0; });
+                if (failure != 0) return;
+
+                if (error != 0) failure = error;
+                else if (doWrite(fd_out, out, compressed) == -1) failure = errno;
+                else {
+                    stats.written += compressed;
+                    if (tracker.Add(in, have) == -1) failure = errno;
+                }
+                nextWrite++;
+                written.notify_all();
+                if (failure != 0) return;
+            }
+        };
+
+        Threads::Run(threads, compressor);
+
+        if (failure != 0) {
+            errno = failure;
+            return -1;
+        }
+        return 0;
+    }
+
+    // The decompress engine, for gzip (any number of members) or zlib
+    // data.  Anything after the last complete member is an error.
+    int GunzipCopy(int fd_in, int fd_out, ProgressTracker& tracker, Stats& stats) {
+        BufferLease buffers = BufferPool::Shared().Borrow(TRANSFORM_CHUNK_SIZE, 2);
+        if (!buffers) {
+            errno = ENOMEM;
+            return -1;
+        }
+        char* const input = buffers[0];
+        char* const output = buffers[1];
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        int result = inflateInit2(&stream, 15 + 32);
+        if (result != Z_OK) {
+            errno = ZlibErrno(result);
+            return -1;
+        }
+
+        stats.written = 0;
+
+        // whether the last member has ended, so the input may too
+        bool ended = false;
+        for (;;) {
+            ssize_t bytes_read = doRead(fd_in, input, TRANSFORM_CHUNK_SIZE);
+            if (bytes_read == -1) goto gunzipError;
+            if (bytes_read == 0) break;
+
+            stream.next_in = (Bytef*) input;
+            stream.avail_in = (uInt) bytes_read;
+
+            // until the input is used up and nothing is left over from
+            // it, which a full output buffer may mean
+            do {
+                if (ended) {
+                    if (stream.avail_in == 0) break;
+                    inflateReset(&stream);
+                    ended = false;
+                }
+
+                stream.next_out = (Bytef*) output;
+                stream.avail_out = (uInt) TRANSFORM_CHUNK_SIZE;
+                result = inflate(&stream, Z_NO_FLUSH);
+                if (result == Z_BUF_ERROR) break; // wants more input
+                if (result != Z_OK && result != Z_STREAM_END) {
+                    errno = ZlibErrno(result);
+                    goto gunzipError;
+                }
+                ended = result == Z_STREAM_END;
+
+                const size_t produced = TRANSFORM_CHUNK_SIZE - stream.avail_out;
+                if (produced > 0 && doWrite(fd_out, output, produced) == -1) goto gunzipError;
+                stats.written += produced;
+            } while (stream.avail_in > 0 || stream.avail_out == 0);
+
+            if (tracker.Add(input, bytes_read) == -1) goto gunzipError;
+        }
+
+        inflateEnd(&stream);
+        if (!ended) {
+            errno = EINVAL; // cut short
+            return -1;
+        }
+        return 0;
+
+    gunzipError:
+        int error = errno;
+        inflateEnd(&stream);
+        errno = error;
+        return -1;
+    }
+
+    // Pieces a parallel copy hands out to its threads, one at a time.  A
+    // file needs at least two of them to be split up.
+    const int64_t PARALLEL_PIECE_SIZE = 8 * 1024 * 1024;
+
+    // The parallel engine: job.Parallel threads take PARALLEL_PIECE_SIZE
+    // pieces of the file in turn and copy them at their own offsets, with
+    // copy_file_range where the kernel can or pread and pwrite through a
+    // buffer of their own.  Striped and parallel filesystems only reach
+    // full speed with several ranges in flight.  Progress from all of
+    // them goes through the one tracker, under a lock, and comes out of
+    // order, so the cache is only dropped once the copy is done.  If the
+    // source shrinks, the destination is cut off where it ended.
+    int ParallelCopy(int fd_in, int fd_out, const Job& job, const struct stat& st, ProgressTracker& tracker) {
+        tracker.Unordered();
+
+        const int64_t size = st.st_size;
+        const int64_t pieces = (size + PARALLEL_PIECE_SIZE - 1) / PARALLEL_PIECE_SIZE;
+        const size_t threads = (size_t) std::min((int64_t) job.Parallel, pieces);
+
+        BufferLease buffers = BufferPool::Shared().Borrow(PIPELINE_CHUNK_SIZE, threads);
+        if (!buffers) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        std::atomic<int64_t> next(0);
+        std::atomic<int> failure(0);
+        std::mutex progress;
+        int64_t ended = size; // where the source turned out to end, under progress
+
+        auto copier = [&](size_t index) {
+            char* const buffer = buffers[index];
+            bool kernel = true;
+
+            for (int64_t piece; failure == 0 && (piece = next++) < pieces; ) {
+                int64_t position = piece * PARALLEL_PIECE_SIZE;
+                const int64_t end = std::min(size, position + PARALLEL_PIECE_SIZE);
+
+                while (position < end && failure == 0) {
+                    const size_t chunk = (size_t) std::min((int64_t) PIPELINE_CHUNK_SIZE, end - position);
+                    int64_t copied = -1;
+#ifdef __NR_copy_file_range
+                    if (kernel) {
+                        loff_t in_offset = position, out_offset = position;
+                        copied = syscall(__NR_copy_file_range, fd_in, &in_offset, fd_out, &out_offset, chunk, 0);
+                        if (copied == -1 && errno == EINTR) continue;
+                        if (copied == -1 && Unsupported(errno)) kernel = false;
+                    }
+#else
+                    kernel = false;
+#endif
+                    if (!kernel) {
+                        copied = doReadAt(fd_in, buffer, chunk, position);
+                        if (copied > 0 && doWriteAt(fd_out, buffer, copied, position) == -1) copied = -1;
+                    }
+
+                    int error = copied == -1 ? errno : 0;
+                    if (copied > 0) {
+                        std::lock_guard<std::mutex> lock(progress);
+                        if (tracker.Add(copied) == -1) error = errno;
+                    }
+                    if (error != 0) {
+                        int none = 0;
+                        failure.compare_exchange_strong(none, error);
+                        return;
+                    }
+
+                    // the source has shrunk since it was looked at
+                    if (copied == 0) {
+                        std::lock_guard<std::mutex> lock(progress);
+                        ended = std::min(ended, position);
+                        break;
+                    }
+                    position += copied;
+                }
+            }
+        };
+
+        Threads::Run(threads, copier);
+
+        if (failure != 0) {
+            errno = failure;
+            return -1;
+        }
+        if (ended < size && ftruncate(fd_out, ended) == -1) return -1;
+        return 0;
+    }
+
+    // Whether an engine passes the data through userspace, where it
+    // can be hashed
+    bool SeesData(Engine engine) {
+        return engine == ENGINE_BUFFERED || engine == ENGINE_PIPELINED ||
+               engine == ENGINE_SPARSE || engine == ENGINE_DIRECT ||
+               engine == ENGINE_MMAP;
+    }
+
+    // Runs one specific engine.  Returns -1 with an Unsupported()
+    // errno if it can't be used here, so the caller can try another.
+    int RunEngine(
+        Engine engine, int fd_in, int fd_out, const Job& job, const struct stat& st,
+        ProgressTracker& tracker
+    ) {
+        switch (engine) {
+            case ENGINE_BUFFERED:
+                return BufferedCopy(fd_in, fd_out, job, st, tracker);
+            case ENGINE_SPARSE:
+                return SparseCopy(fd_in, fd_out, job, st, tracker);
+            case ENGINE_DIRECT:
+                return DirectCopy(fd_in, fd_out, job, st, tracker);
+            case ENGINE_MMAP:
+                return MmapCopy(fd_in, fd_out, st, tracker);
+            case ENGINE_PIPELINED:
+                return PipelinedCopy(fd_in, fd_out, job, st,
+                    job.Pipeline > 0 ? job.Pipeline : DEFAULT_PIPELINE_DEPTH, tracker);
+#ifdef __linux__
+            case ENGINE_REFLINK:
+                return Reflink(fd_in, fd_out);
+            case ENGINE_COPY_FILE_RANGE:
+            case ENGINE_SENDFILE:
+                return KernelCopy(fd_in, fd_out, tracker, engine);
+#endif
+#ifdef NATIVEFS_HAVE_IO_URING
+            case ENGINE_IO_URING:
+                return UringCopy(fd_in, fd_out, job, st, tracker);
+#endif
+#ifdef __APPLE__
+            case ENGINE_FCOPYFILE:
+                return FCopyFile(fd_in, fd_out, st, tracker);
+#endif
+            default:
+                errno = ENOTSUP;
+                return -1;
+        }
+    }
+
+    // Moves the data, trying the cheapest mechanism available first:
+    // a reflink shares the extents outright, copy_file_range and
+    // sendfile keep the bytes in the kernel, and the buffered loop is
+    // the fallback that works everywhere.  Copies between devices go
+    // through the pipeline instead, which keeps both of them busy.
+    int Transfer(
+        int fd_in, int fd_out, const Job& job, const struct stat& st,
+        ProgressTracker& tracker, Stats& stats
+    ) {
+        const int64_t inputSize = st.st_size;
+        const int depth = PipelineDepth(fd_out, job, st);
+
+        // A checksum is computed from the data as it goes by, which
+        // rules out everything that leaves the copying to the kernel.
+        const bool hashing = tracker.Hashing();
+
+        if (job.Transform == TRANSFORM_GZIP) {
+            stats.engine = ENGINE_GZIP;
+            return GzipCopy(fd_in, fd_out, job, st, tracker, stats);
+        }
+        if (job.Transform == TRANSFORM_GUNZIP) {
+            stats.engine = ENGINE_GUNZIP;
+            return GunzipCopy(fd_in, fd_out, tracker, stats);
+        }
+
+        // an existing destination is patched where it differs
+        if (job.Incremental && inputSize > 0) {
+            struct stat existing;
+            if (fstat(fd_out, &existing) == 0 && existing.st_size > 0) {
+                stats.engine = ENGINE_INCREMENTAL;
+                return IncrementalCopy(fd_in, fd_out, existing.st_size, tracker, stats);
+            }
+        }
+
+        // an engine asked for by name gets first go, and the usual
+        // order applies if it turns out not to work here before it has
+        // copied anything
+        if (job.PreferredEngine != ENGINE_NONE && (!hashing || SeesData(job.PreferredEngine))) {
+            const bool writesEverything =
+                job.PreferredEngine != ENGINE_REFLINK && job.PreferredEngine != ENGINE_SPARSE;
+            if (inputSize > 0 && job.Preallocate && writesEverything &&
+                Preallocate(fd_out, inputSize) == -1) {
+                return -1;
+            }
+
+            if (RunEngine(job.PreferredEngine, fd_in, fd_out, job, st, tracker) == 0) {
+                stats.engine = job.PreferredEngine;
+                return 0;
+            }
+            // having written some of it, it can't start over with another
+            if (!Unsupported(errno) || tracker.Progress() > 0) return -1;
+        }
+
+#ifdef __linux__
+        // Files like those in /proc report a size of 0 and make the
+        // kernel engines return early, so leave them to the loop.
+        if (inputSize > 0 && !hashing) {
+            if (Reflink(fd_in, fd_out) == 0) {
+                stats.engine = ENGINE_REFLINK;
+                return 0;
+            }
+        }
+#endif
+
+        // every other engine goes through the page cache
+        if (inputSize > 0 && job.Cache == CACHE_DIRECT) {
+            if (job.Preallocate && Preallocate(fd_out, inputSize) == -1) return -1;
+
+            if (DirectCopy(fd_in, fd_out, job, st, tracker) == 0) {
+                stats.engine = ENGINE_DIRECT;
+                return 0;
+            }
+            if (errno != ENOTSUP) return -1;
+        }
+
+        // holes would otherwise be read back as zeros and written out
+        if (inputSize > 0 && job.Sparse != 0 && (job.Sparse == 1 || LooksSparse(fd_in, st))) {
+            if (SparseCopy(fd_in, fd_out, job, st, tracker) == 0) {
+                stats.engine = ENGINE_SPARSE;
+                return 0;
+            }
+            if (errno != ENOTSUP) return -1;
+        }
+
+        // Everything from here on writes every byte.  A reflink needs
+        // no space of its own and a sparse copy wants to keep its
+        // holes, which is why this waits until both have been ruled out.
+        if (inputSize > 0 && job.Preallocate && Preallocate(fd_out, inputSize) == -1) {
+            return -1;
+        }
+
+        // the pieces can't be hashed out of order
+        if (job.Parallel > 1 && inputSize >= 2 * PARALLEL_PIECE_SIZE && !hashing) {
+            stats.engine = ENGINE_PARALLEL;
+            return ParallelCopy(fd_in, fd_out, job, st, tracker);
+        }
+
+#ifdef __linux__
+
+        if (inputSize > 0 && depth == 0 && !hashing) {
+            const Engine kernelEngines[] = { ENGINE_COPY_FILE_RANGE, ENGINE_SENDFILE };
+            for (Engine engine : kernelEngines) {
+                if (KernelCopy(fd_in, fd_out, tracker, engine) == 0) {
+                    stats.engine = engine;
+                    return 0;
+                }
+                if (!Unsupported(errno)) return -1;
+            }
+        }
+#endif
+
+#ifdef __APPLE__
+        if (inputSize > 0 && depth == 0 && !hashing) {
+            if (FCopyFile(fd_in, fd_out, st, tracker) == 0) {
+                stats.engine = ENGINE_FCOPYFILE;
+                return 0;
+            }
+            if (!Unsupported(errno)) return -1;
+        }
+#endif
+
+        if (depth > 0) {
+            stats.engine = ENGINE_PIPELINED;
+            return PipelinedCopy(fd_in, fd_out, job, st, depth, tracker);
+        }
+
+        stats.engine = ENGINE_BUFFERED;
+        return BufferedCopy(fd_in, fd_out, job, st, tracker);
+    }
+
+    // Reads the destination back and compares its digest with that of
+    // the data written.  Once the data has been flushed, dropping its
+    // pages first makes this read what actually reached the disk.
+    // Returns -1 with errno set to EIO on a mismatch.
+    int VerifyCopy(int fd_out, const Job& job, const std::string& expected) {
+        const size_t VERIFY_CHUNK_SIZE = 1024 * 1024;
+
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd_out, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+        std::unique_ptr<Hasher> hasher(Hasher::Create(job.Checksum));
+        BufferLease buffer = BufferPool::Shared().Borrow(VERIFY_CHUNK_SIZE);
+        if (!buffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (lseek(fd_out, 0, SEEK_SET) == -1) return -1;
+
+        ssize_t bytes_read;
+        while ((bytes_read = doRead(fd_out, buffer.get(), VERIFY_CHUNK_SIZE)) > 0) {
+            hasher->Update(buffer.get(), bytes_read);
+        }
+        if (bytes_read == -1) return -1;
+
+        if (hasher->Digest() != expected) {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+
+    // The destination of an atomic copy.  The data goes to an anonymous
+    // O_TMPFILE where the filesystem has them, or to a hidden name next
+    // to the destination, and only shows up under the destination's name
+    // once Publish() has run: readers never see a partial file, and a
+    // failed copy leaves whatever was there before alone.
+    class StagedFile {
+        public:
+            // name is looked up in dir, which may be AT_FDCWD.  Unless
+            // replace is set, publishing fails with EEXIST if name exists.
+            StagedFile(int dir, const std::string& name, bool replace = true)
+                : dir(dir), name(name), replace(replace), anonymous(false) {}
+
+            // Returns the file descriptor to write to, or -1
+            int Open(int flags, int mode) {
+#if defined(O_TMPFILE)
+                // naming the file later takes /proc
+                if (access("/proc/self/fd", X_OK) == 0) {
+                    int fd = openat(dir, Parent(name).c_str(), O_TMPFILE | flags, mode);
+                    if (fd >= 0) {
+                        anonymous = true;
+                        return fd;
+                    }
+                }
+#endif
+                for (int attempt = 0; attempt < 16; attempt++) {
+                    temporary = TemporaryName();
+#ifdef _WIN32
+                    int fd = open(temporary.c_str(), flags | O_CREAT | O_EXCL | O_BINARY, mode);
+#else
+                    int fd = openat(dir, temporary.c_str(), flags | O_CREAT | O_EXCL, mode);
+#endif
+                    if (fd >= 0) return fd;
+                    if (errno != EEXIST) break;
+                }
+                temporary.clear();
+                return -1;
+            }
+
+            // Puts the complete file in place and closes fd.  Returns 0,
+            // or -1 with errno set, having discarded the file.
+            int Publish(int fd) {
+#if defined(O_TMPFILE)
+                if (anonymous) {
+                    const std::string self = "/proc/self/fd/" + std::to_string(fd);
+
+                    int result = linkat(AT_FDCWD, self.c_str(), dir, name.c_str(), AT_SYMLINK_FOLLOW);
+                    if (result == -1 && errno == EEXIST && replace) {
+                        // linkat() won't replace a file, rename() will
+                        for (int attempt = 0; attempt < 16; attempt++) {
+                            temporary = TemporaryName();
+                            result = linkat(AT_FDCWD, self.c_str(), dir, temporary.c_str(), AT_SYMLINK_FOLLOW);
+                            if (result == 0 || errno != EEXIST) break;
+                        }
+                        if (result == 0) {
+                            anonymous = false;
+                            result = renameat(dir, temporary.c_str(), dir, name.c_str());
+                        }
+                        else {
+                            temporary.clear();
+                        }
+                    }
+
+                    int error = errno;
+                    close(fd);
+                    if (result == -1) {
+                        Discard();
+                        errno = error;
+                    }
+                    return result;
+                }
+#endif
+                close(fd);
+
+#ifdef _WIN32
+                int result = MoveFileExA(temporary.c_str(), name.c_str(),
+                                         replace ? MOVEFILE_REPLACE_EXISTING : 0) ? 0 : -1;
+                if (result == -1) errno = ErrnoFromWindows(GetLastError());
+#else
+                int result;
+                if (replace) {
+                    result = renameat(dir, temporary.c_str(), dir, name.c_str());
+                }
+                else {
+                    // linkat() fails where rename() would replace
+                    result = linkat(dir, temporary.c_str(), dir, name.c_str(), 0);
+                    if (result == 0) {
+                        unlinkat(dir, temporary.c_str(), 0);
+                        temporary.clear();
+                    }
+                }
+#endif
+                if (result == -1) {
+                    int error = errno;
+                    Discard();
+                    errno = error;
+                }
+                return result;
+            }
+
+            // Flushes the directory the published file is in
+            int Sync() const {
+                return SyncEntry(dir, name);
+            }
+
+            // Gets rid of the unfinished file, once it has been closed
+            void Discard() {
+                if (temporary.empty()) return;
+#ifdef _WIN32
+                remove(temporary.c_str());
+#else
+                unlinkat(dir, temporary.c_str(), 0);
+#endif
+                temporary.clear();
+            }
+
+            // Puts a hard link to target in place instead of a new
+            // file.  Returns 0, or -1 with errno set.
+            int Link(const std::string& target) {
+                if (MakeLink(target, name) == 0) return 0;
+                if (errno != EEXIST || !replace) return -1;
+
+                // a link won't replace anything, a rename will
+                int result = -1;
+                for (int attempt = 0; attempt < 16; attempt++) {
+                    temporary = TemporaryName();
+                    result = MakeLink(target, temporary);
+                    if (result == 0 || errno != EEXIST) break;
+                }
+                if (result == -1) {
+                    temporary.clear();
+                    return -1;
+                }
+
+#ifdef _WIN32
+                result = MoveFileExA(temporary.c_str(), name.c_str(), MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+                if (result == -1) errno = ErrnoFromWindows(GetLastError());
+#else
+                result = renameat(dir, temporary.c_str(), dir, name.c_str());
+#endif
+                if (result == -1) {
+                    int error = errno;
+                    Discard();
+                    errno = error;
+                }
+                temporary.clear();
+                return result;
+            }
+
+        private:
+            const int dir;
+            const std::string name;
+            const bool replace;
+
+            std::string temporary; // empty while the file has no name
+            bool anonymous;
+
+            int MakeLink(const std::string& target, const std::string& path) {
+#ifdef _WIN32
+                if (CreateHardLinkA(path.c_str(), target.c_str(), NULL)) return 0;
+                errno = ErrnoFromWindows(GetLastError());
+                return -1;
+#else
+                return linkat(AT_FDCWD, target.c_str(), dir, path.c_str(), 0);
+#endif
+            }
+
+            // ".name.<n>.tmp" in the destination's directory
+            std::string TemporaryName() const {
+                static std::atomic<unsigned> counter(0);
+
+                const unsigned long long unique =
+                    (unsigned long long) std::chrono::steady_clock::now().time_since_epoch().count() +
+                    counter.fetch_add(1);
+
+                const size_t slash = name.find_last_of(PATH_SEPARATORS);
+                const std::string directory = slash == std::string::npos ? "" : name.substr(0, slash + 1);
+                const std::string base = slash == std::string::npos ? name : name.substr(slash + 1);
+
+                return directory + "." + base + "." + std::to_string(unique) + ".tmp";
+            }
+    };
+
+#ifdef __linux__
+    // from linux/ioprio.h, which not every libc exposes
+    const int IOPRIO_WHO_PROCESS = 1;
+    const int IOPRIO_CLASS_SHIFT = 13;
+    const int IOPRIO_CLASS_BE = 2;
+    const int IOPRIO_CLASS_IDLE = 3;
+#endif
+
+    // Lowers the calling thread's I/O priority for as long as it lives,
+    // and then puts it back: the threads belong to the pool and go on to
+    // run other work.  Linux sets an ioprio class, which schedulers like
+    // BFQ act on, and macOS a throttled disk policy.  Windows gives its
+    // hints per handle instead, see SetIoPriorityHint().
+    class IoPriorityScope {
+        public:
+            explicit IoPriorityScope(int priority) : previous(-1) {
+                if (priority == IO_PRIORITY_NORMAL) return;
+#if defined(__linux__)
+                const int value = priority == IO_PRIORITY_IDLE
+                    ? IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+                    : (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+                previous = (int) syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+                if (previous != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) == -1) {
+                    previous = -1;
+                }
+#elif defined(__APPLE__)
+                previous = getiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD);
+                const int policy = priority == IO_PRIORITY_IDLE ? IOPOL_THROTTLE : IOPOL_UTILITY;
+                if (previous != -1 && setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, policy) == -1) {
+                    previous = -1;
+                }
+#endif
+            }
+
+            ~IoPriorityScope() {
+                if (previous == -1) return;
+#if defined(__linux__)
+                syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, previous);
+#elif defined(__APPLE__)
+                setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, previous);
+#endif
+            }
+
+        private:
+            int previous; // -1 if nothing was changed
+    };
+
+#ifdef _WIN32
+    // Windows' take on IoPriorityScope, for one file handle.  Errors are
+    // ignored: the copy works just as well at normal priority.
+    void SetIoPriorityHint(int fd, int priority) {
+        if (priority == IO_PRIORITY_NORMAL) return;
+
+        FILE_IO_PRIORITY_HINT_INFO hint;
+        hint.PriorityHint = priority == IO_PRIORITY_IDLE ? IoPriorityHintVeryLow : IoPriorityHintLow;
+        SetFileInformationByHandle((HANDLE) _get_osfhandle(fd), FileIoPriorityHintInfo, &hint, sizeof(hint));
+    }
+#endif
+
+    // Copies everything from fd_in to fd_out and closes both.  Returns
+    // 0 on success or the errno of the failure, in which case the
+    // destination has been removed, unless a resumable copy can carry on
+    // with it.  A staged destination is published once it is complete,
+    // or discarded.
+    int Copy(
+        int fd_in, int fd_out, const struct stat& st,
+        const Job& job, Reporter& reporter, Stats& stats,
+        bool removeWhenDone = false, StagedFile* staged = nullptr
+    ) {
+        IoPriorityScope priority(job.IoPriority);
+#ifdef _WIN32
+        SetIoPriorityHint(fd_in, job.IoPriority);
+        SetIoPriorityHint(fd_out, job.IoPriority);
+#endif
+
+        CacheDropper dropper(fd_in, fd_out, job);
+        std::unique_ptr<Hasher> hasher(Hasher::Create(job.Checksum));
+        ProgressTracker tracker(job, reporter, st.st_size, &dropper, hasher.get());
+
+        Stopwatch clock;
+        int error;
+
+        // only regular files can be resumed (or usefully checkpointed)
+        std::unique_ptr<ResumeJournal> journal;
+        if (job.Resume && (st.st_mode & S_IFMT) == S_IFREG && st.st_size > 0) {
+            journal.reset(new ResumeJournal(job.Destination, st));
+            stats.engine = ENGINE_RESUMABLE;
+        }
+
+        int transferred = journal
+            ? ResumableCopy(fd_in, fd_out, job, st, *journal, tracker, stats)
+            : Transfer(fd_in, fd_out, job, st, tracker, stats);
+        stats.reads = tracker.Reads();
+        stats.writes = tracker.Writes();
+        stats.transferTime = clock.Lap();
+        if (transferred == -1) goto copyByFdError;
+
+        tracker.Finish();
+        stats.bytes = (double) st.st_size;
+
+        if (CopyMetadata(fd_in, fd_out, st, job) == -1) goto copyByFdError;
+
+        if (Flush(fd_out, job, removeWhenDone) == -1) goto copyByFdError;
+        stats.flushTime = clock.Lap();
+
+        if (hasher) {
+            stats.checksum = hasher->Digest();
+            if (job.Verify && VerifyCopy(fd_out, job, stats.checksum) == -1) goto copyByFdError;
+            stats.verifyTime = clock.Lap();
+        }
+
+        dropper.Finish();
+
+        close(fd_in);
+
+        if (staged == nullptr) {
+            close(fd_out);
+        }
+        else if (staged->Publish(fd_out) == -1) {
+            return errno;
+        }
+
+        if (journal) journal->Remove();
+
+        // A move is about to remove the source, and an atomic copy
+        // promises the new file is there for good once it is
+        // published, so their names are made durable too.  Plain
+        // copies leave that to the next sync, as cp does.
+        if (removeWhenDone || (staged != nullptr && job.Durability != DURABILITY_BATCH &&
+                               job.Durability != DURABILITY_NONE)) {
+            if ((staged != nullptr ? staged->Sync() : SyncEntry(AT_FDCWD, job.Destination)) == -1) {
+                // a move fails with the source still there; an atomic
+                // copy has already replaced the old file
+                error = errno;
+                if (removeWhenDone) remove(job.Destination);
+                return error;
+            }
+        }
+        stats.renameTime = clock.Lap();
+
+        if (removeWhenDone) {
+            remove(job.Source);
+        }
+
+        return 0;
+
+    copyByFdError:
+        error = errno;
+
+        close(fd_in);
+        close(fd_out);
+
+        if (staged != nullptr) {
+            staged->Discard();
+        }
+        else if (journal && transferred == -1) {
+            // kept, with its journal, for the next attempt
+        }
+        else {
+            if (journal) journal->Remove();
+            remove(job.Destination); // remove failed copy
+        }
+        return error;
+    }
+
+    // Copies one file by path.  Returns 0 or an errno value.
+    int CopyPath(const Job& job, Reporter& reporter, Stats& stats) {
+        // a batch that was paused or cancelled starts no more files
+        if (job.Checkpoint() == -1) return errno;
+
+        Stopwatch clock;
+        int error;
+        int out, in = open(job.Source, O_RDONLY | O_BINARY);
+        if (in < 0) goto copyByPathError;
+
+
+        struct stat st;
+
+        // Get the input file information
+        if (fstat(in, &st) != 0) {
+            error = errno;
+            close(in);
+            errno = error;
+            goto copyByPathError;
+        }
+
+        {
+            struct stat existing;
+            if (job.Incremental && statPath(job.Destination, existing) == 0 && UpToDate(job, st, existing)) {
+                close(in);
+
+                stats.engine = ENGINE_INCREMENTAL;
+                stats.bytes = (double) st.st_size;
+                stats.written = 0;
+                if (job.UpdateProgress) {
+                    reporter.Update((double) st.st_size, (double) st.st_size);
+                }
+                return 0;
+            }
+
+            StagedFile staged(AT_FDCWD, job.Destination, job.Replace != REPLACE_NEVER);
+
+            out = job.Atomic
+                ? staged.Open(OutputAccess(job), st.st_mode)
+                : open(job.Destination, OutputAccess(job) | O_CREAT | OutputTruncate(job) | O_BINARY, st.st_mode);
+            if (out < 0) {
+                error = errno;
+                close(in);
+                errno = error;
+                goto copyByPathError;
+            }
+
+            stats.openTime = clock.Lap();
+            return Copy(in, out, st, job, reporter, stats, false, job.Atomic ? &staged : nullptr);
+        }
+
+    copyByPathError:
+        error = errno;
+        if (!job.Atomic && !job.Resume && job.Replace != REPLACE_NEVER) remove(job.Destination); // remove failed copy
+        return error;
+    }
+
+    // Gives job.Destination the contents of copy, an earlier copy of
+    // the same source: a hard link to it for DEDUP_LINK, otherwise (or
+    // where the link can't be made: another filesystem, too many links)
+    // a copy of it, reflinked where the filesystem can.  Returns 0 or
+    // an errno value.
+    int CopyDuplicate(const std::string& copy, const Job& job, Reporter& reporter, Stats& stats) {
+        if (job.Dedup == DEDUP_LINK) {
+            if (job.Checkpoint() == -1) return errno;
+
+            Stopwatch clock;
+            StagedFile staged(AT_FDCWD, job.Destination, job.Replace != REPLACE_NEVER);
+            if (staged.Link(copy) == 0) {
+                struct stat st;
+                stats.engine = ENGINE_LINK;
+                stats.bytes = statPath(copy, st) == 0 ? (double) st.st_size : 0;
+                stats.renameTime = clock.Lap();
+
+                if (job.UpdateProgress) {
+                    reporter.Update(stats.bytes, stats.bytes);
+                }
+                return 0;
+            }
+            if (errno == EEXIST) return errno;
+        }
+
+        return CopyPath(job.ForDuplicate(copy), reporter, stats);
+    }
+
+    // SHA-256 of a file's contents, empty if it can't be read
+    std::string Fingerprint(const std::string& path) {
+        const size_t FINGERPRINT_CHUNK_SIZE = 1024 * 1024;
+
+        int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+        if (fd < 0) return "";
+
+        std::unique_ptr<Hasher> hasher(Hasher::Create(CHECKSUM_SHA256));
+        BufferLease buffer = BufferPool::Shared().Borrow(FINGERPRINT_CHUNK_SIZE);
+
+        ssize_t bytes_read = -1;
+        if (buffer) {
+            while ((bytes_read = doRead(fd, buffer.get(), FINGERPRINT_CHUNK_SIZE)) > 0) {
+                hasher->Update(buffer.get(), bytes_read);
+            }
+        }
+        close(fd);
+
+        return bytes_read == 0 ? hasher->Digest() : "";
+    }
+
+    // For the dedup option: sets originals[i] to the first file of the
+    // batch whose source is the same as file i's, which is the same file
+    // (device and inode) or, with job.DedupContent, one with the same
+    // size and SHA-256.  Only sizes shared by several distinct files
+    // get hashed.  sources[i] is only valid where known[i] is set.
+    void FindDuplicates(const Job& job, const std::vector<Paths>& files,
+                        const std::vector<struct stat>& sources, const std::vector<bool>& known,
+                        std::vector<size_t>& originals) {
+        std::map<std::pair<dev_t, ino_t>, size_t> inodes;
+        std::map<int64_t, std::vector<size_t>> sizes;
+
+        for (size_t i = 0; i < files.size(); i++) {
+            originals[i] = i;
+            if (!known[i] || (sources[i].st_mode & S_IFMT) != S_IFREG) continue;
+
+            auto first = inodes.emplace(std::make_pair(sources[i].st_dev, sources[i].st_ino), i);
+            if (!first.second) {
+                originals[i] = first.first->second;
+            }
+            else if (job.DedupContent && sources[i].st_size > 0) {
+                sizes[sources[i].st_size].push_back(i);
+            }
+        }
+
+        for (const auto& size : sizes) {
+            if (size.second.size() < 2) continue;
+
+            std::map<std::string, size_t> digests;
+            for (size_t i : size.second) {
+                const std::string digest = Fingerprint(files[i].Source);
+                if (digest.empty()) continue;
+
+                auto first = digests.emplace(digest, i);
+                if (!first.second) originals[i] = first.first->second;
+            }
+        }
+
+        // the same file may have matched a duplicate by content; an
+        // original always comes first, so one pass resolves those
+        for (size_t i = 0; i < files.size(); i++) {
+            originals[i] = originals[originals[i]];
+        }
+    }
+
+    // Renames the source over the destination, or not, as job.Replace
+    // says.  Returns 0, or -1 with errno set; EXDEV means the two are
+    // on different filesystems and the file has to be copied.
+    int RenamePath(const Job& job) {
+#ifdef _WIN32
+        if (job.Replace == REPLACE_EXCHANGE) {
+            errno = ENOTSUP;
+            return -1;
+        }
+
+        const DWORD flags = job.Replace == REPLACE_ALWAYS ? MOVEFILE_REPLACE_EXISTING : 0;
+        if (MoveFileExA(job.Source, job.Destination, flags)) return 0;
+
+        errno = ErrnoFromWindows(GetLastError());
+        return -1;
+#else
+        if (job.Replace == REPLACE_ALWAYS) return rename(job.Source, job.Destination);
+
+#if defined(__linux__) && defined(__NR_renameat2) && defined(RENAME_NOREPLACE)
+        const unsigned int flags = job.Replace == REPLACE_NEVER ? RENAME_NOREPLACE : RENAME_EXCHANGE;
+        if (syscall(__NR_renameat2, AT_FDCWD, (const char*) job.Source,
+                    AT_FDCWD, (const char*) job.Destination, flags) == 0) {
+            return 0;
+        }
+        // EINVAL: the filesystem doesn't do flags
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+#elif defined(__APPLE__) && defined(RENAME_EXCL)
+        const unsigned int flags = job.Replace == REPLACE_NEVER ? RENAME_EXCL : RENAME_SWAP;
+        if (renamex_np(job.Source, job.Destination, flags) == 0) return 0;
+        if (errno != ENOTSUP) return -1;
+#endif
+
+        if (job.Replace == REPLACE_EXCHANGE) {
+            errno = ENOTSUP;
+            return -1;
+        }
+
+        // link() won't replace anything either
+        if (link(job.Source, job.Destination) == -1) return -1;
+        return unlink(job.Source);
+#endif
+    }
+
+    // Moves one file by path.  Returns 0 or an errno value.
+    int MovePath(const Job& job, Reporter& reporter, Stats& stats) {
+        if (job.Checkpoint() == -1) return errno;
+
+        struct stat in_stats, parent_stats;
+        if (statPath(job.Source, in_stats) != 0) return errno;
+
+        // The destination's directory says whether a rename can work,
+        // without touching the destination itself.
+        if (statPath(Parent(job.Destination), parent_stats) != 0) return errno;
+
+        Stopwatch clock;
+        if (in_stats.st_dev == parent_stats.st_dev) {
+            if (RenamePath(job) == 0) {
+                const double inputSize = (double) in_stats.st_size;
+                stats.engine = ENGINE_RENAME;
+                stats.bytes = inputSize;
+                stats.renameTime = clock.Lap();
+
+                if (job.UpdateProgress) {
+                    reporter.Update(inputSize, inputSize);
+                }
+                return 0;
+            }
+
+            // a bind mount can share the device and still not allow it
+            if (errno != EXDEV) return errno;
+        }
+
+        // Two files can't be swapped by copying them.
+        if (job.Replace == REPLACE_EXCHANGE) return EXDEV;
+
+        // They're on different devices.  We'll need to
+        // do this as a copy followed by a remove.
+        int error;
+        int out, in = open(job.Source, O_RDONLY | O_BINARY);
+        if (in < 0) return errno;
+
+        if (fstat(in, &in_stats) != 0) {
+            error = errno;
+            close(in);
+            return error;
+        }
+
+        StagedFile staged(AT_FDCWD, job.Destination, job.Replace == REPLACE_ALWAYS);
+
+        out = job.Atomic
+            ? staged.Open(OutputAccess(job), in_stats.st_mode)
+            : open(job.Destination, OutputAccess(job) | O_CREAT | OutputTruncate(job) | O_BINARY, in_stats.st_mode);
+        if (out < 0) {
+            error = errno;
+            close(in);
+            return error;
+        }
+
+        stats.openTime = clock.Lap();
+        return Copy(in, out, in_stats, job, reporter, stats, /* removeWhenDone: */ true,
+                    job.Atomic ? &staged : nullptr);
+    }
+
+    // Whether a device is a spinning disk, going by sysfs.  Whatever
+    // can't be told (network and virtual filesystems, other systems) is
+    // taken not to be one.
+    bool IsRotational(dev_t device) {
+#ifdef __linux__
+        const std::string base = "/sys/dev/block/" +
+            std::to_string(major(device)) + ":" + std::to_string(minor(device));
+
+        // partitions keep their queue in the whole disk's directory
+        const std::string candidates[] = { base + "/queue/rotational", base + "/../queue/rotational" };
+        for (const std::string& path : candidates) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) continue;
+
+            char flag = '0';
+            ssize_t length = read(fd, &flag, 1);
+            close(fd);
+            return length == 1 && flag == '1';
+        }
+#endif
+        return false;
+    }
+
+    // Hands out I/O streams per device, so concurrent copies don't turn
+    // a spinning disk into a seek storm: one of those gets
+    // RotationalConcurrency streams, anything else as many as the job
+    // runs at once.  A copy takes a stream on both of its devices, or
+    // one if they're the same.
+    class DeviceStreams {
+        public:
+            explicit DeviceStreams(const Job& job)
+                : rotationalStreams(job.RotationalConcurrency), otherStreams(job.Concurrency) {}
+
+            // Blocks until both devices have a stream free
+            void Acquire(dev_t source, dev_t destination) {
+                std::unique_lock<std::mutex> lock(mutex);
+                released.wait(lock, [&] { return Available(source, destination); });
+                Take(source, destination, 1);
+            }
+
+            void Release(dev_t source, dev_t destination) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    Take(source, destination, -1);
+                }
+                released.notify_all();
+            }
+
+        protected:
+            std::mutex mutex;
+            std::condition_variable released;
+
+            // Called with the mutex held
+            bool Available(dev_t source, dev_t destination) {
+                return Streams(source).used < Streams(source).limit &&
+                       Streams(destination).used < Streams(destination).limit;
+            }
+
+            void Take(dev_t source, dev_t destination, int count) {
+                Streams(source).used += count;
+                if (destination != source) Streams(destination).used += count;
+            }
+
+        private:
+            struct Device {
+                int limit;
+                int used;
+            };
+
+            const int rotationalStreams;
+            const int otherStreams;
+            std::vector<std::pair<dev_t, Device>> devices;
+
+            Device& Streams(dev_t device) {
+                for (auto& known : devices) {
+                    if (known.first == device) return known.second;
+                }
+                const int limit = IsRotational(device) ? rotationalStreams : otherStreams;
+                devices.emplace_back(device, Device{ std::max(limit, 1), 0 });
+                return devices.back().second;
+            }
+    };
+
+    // The files of a batch, queued by the pair of devices they are on.
+    // The queues take turns, and a queue whose devices are busy is
+    // passed over, so every device is kept as busy as it can usefully
+    // be instead of all the threads piling onto one disk.
+    class BatchScheduler : public DeviceStreams {
+        public:
+            explicit BatchScheduler(const Job& job) : DeviceStreams(job), turn(0), pending(0) {}
+
+            void Add(size_t task, dev_t source, dev_t destination) {
+                for (Queue& queue : queues) {
+                    if (queue.source == source && queue.destination == destination) {
+                        queue.tasks.push_back(task);
+                        pending++;
+                        return;
+                    }
+                }
+                queues.push_back(Queue{ source, destination, std::deque<size_t>(1, task) });
+                pending++;
+            }
+
+            // Waits for a task whose devices have a stream free, and
+            // takes it along with the streams.  False once there are
+            // none left.
+            bool Next(size_t& task, dev_t& source, dev_t& destination) {
+                std::unique_lock<std::mutex> lock(mutex);
+                for (;;) {
+                    if (pending == 0) return false;
+
+                    for (size_t i = 0; i < queues.size(); i++) {
+                        Queue& queue = queues[(turn + i) % queues.size()];
+                        if (queue.tasks.empty() || !Available(queue.source, queue.destination)) continue;
+
+                        task = queue.tasks.front();
+                        queue.tasks.pop_front();
+                        pending--;
+
+                        source = queue.source;
+                        destination = queue.destination;
+                        Take(source, destination, 1);
+
+                        turn = (turn + i + 1) % queues.size();
+                        return true;
+                    }
+
+                    released.wait(lock);
+                }
+            }
+
+        private:
+            struct Queue {
+                dev_t source;
+                dev_t destination;
+                std::deque<size_t> tasks;
+            };
+
+            std::vector<Queue> queues;
+            size_t turn;
+            size_t pending;
+    };
+
+    // A pool of threads, each with its own deque of tasks.  Threads
+    // take work from the back of their own deque, which walks a tree
+    // depth first and keeps few directories open, and steal from the
+    // front of the others' when they run dry.
+    class WorkPool {
+        public:
+            // Tasks get the index of the thread running them, which is
+            // what they should pass to Push().
+            typedef std::function<void(size_t worker)> Task;
+
+            WorkPool(size_t threads) : pending(0), pushes(0) {
+                for (size_t i = 0; i < std::max((size_t) 1, threads); i++) {
+                    queues.emplace_back(new Queue);
+                }
+            }
+
+            void Push(size_t worker, Task task) {
+                pending++;
+                {
+                    Queue& queue = *queues[worker % queues.size()];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    queue.tasks.push_back(std::move(task));
+                }
+
+                std::lock_guard<std::mutex> lock(idleMutex);
+                pushes++;
+                idle.notify_one();
+            }
+
+            // Runs until every task, including the ones pushed by other
+            // tasks, has finished.  The calling thread is worker 0.
+            void Run() {
+                std::vector<std::thread> threads;
+                for (size_t i = 1; i < queues.size(); i++) {
+                    threads.emplace_back(&WorkPool::Work, this, i);
+                }
+                Work(0);
+
+                for (std::thread& thread : threads) thread.join();
+            }
+
+        private:
+            struct Queue {
+                std::mutex mutex;
+                std::deque<Task> tasks;
+            };
+
+            std::vector<std::unique_ptr<Queue>> queues;
+
+            std::atomic<size_t> pending; // pushed but not yet finished
+
+            std::mutex idleMutex;
+            std::condition_variable idle;
+            size_t pushes; // lets idle threads spot pushes they missed
+
+            bool Take(size_t worker, Task& task) {
+                for (size_t i = 0; i < queues.size(); i++) {
+                    Queue& queue = *queues[(worker + i) % queues.size()];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    if (queue.tasks.empty()) continue;
+
+                    if (i == 0) {
+                        task = std::move(queue.tasks.back());
+                        queue.tasks.pop_back();
+                    }
+                    else {
+                        task = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                    }
+                    return true;
+                }
+                return false;
+            }
+
+            void Work(size_t worker) {
+                for (;;) {
+                    size_t seen;
+                    {
+                        std::lock_guard<std::mutex> lock(idleMutex);
+                        seen = pushes;
+                    }
+
+                    Task task;
+                    if (Take(worker, task)) {
+                        task(worker);
+                        task = nullptr; // drop what it holds before it counts as done
+
+                        if (--pending == 0) {
+                            std::lock_guard<std::mutex> lock(idleMutex);
+                            idle.notify_all();
+                        }
+                        continue;
+                    }
+
+                    std::unique_lock<std::mutex> lock(idleMutex);
+                    idle.wait(lock, [this, seen] {
+                        return pending == 0 || pushes != seen;
+                    });
+                    if (pending == 0) return;
+                }
+            }
+    };
+
+#ifndef _WIN32
+    class TreeCopier;
+
+    // A directory being copied, open on both sides.  The destination's
+    // mode and timestamps can only be set once everything inside it
+    // has been written, so that happens when the last task holding on
+    // to it lets go, which is also when a move removes the source.
+    struct DirPair {
+        TreeCopier& copier;
+        const std::shared_ptr<DirPair> parent;
+        const std::string name;
+        const std::string sourcePath;
+        const std::string destinationPath;
+
+        DIR* source;
+        int destination;
+        struct stat st;
+
+        DirPair(TreeCopier& copier, std::shared_ptr<DirPair> parent, const std::string& name,
+                const std::string& sourcePath, const std::string& destinationPath)
+            : copier(copier), parent(parent), name(name),
+              sourcePath(sourcePath), destinationPath(destinationPath),
+              source(nullptr), destination(-1) {}
+
+        ~DirPair();
+
+        int sourceFd() const { return dirfd(source); }
+    };
+
+    // Copies or moves a directory tree.  Every directory is listed by
+    // one task, and every regular file inside it becomes a task of its
+    // own, all on a WorkPool.  A move tries renameat() first for every
+    // entry, so a whole subtree is moved at once when it can be.
+    class TreeCopier {
+        public:
+            TreeCopier(const Job& job, bool move, Reporter& reporter)
+                : job(job), move(move), reporter(reporter), pool(job.Concurrency),
+                  streams(job), destinationDevice(0), failure(0), crossDevice(false), renamed(false),
+                  filesFound(0), filesDone(0), bytesDone(0) {}
+
+            // Returns 0 or an errno value
+            int Run() {
+                if (move) {
+                    if (rename(job.Source, job.Destination) == 0) {
+                        renamed = true;
+                        return 0;
+                    }
+
+                    // anything else is tried again, one entry at a time
+                    if (errno != EXDEV && errno != ENOTEMPTY && errno != EEXIST) return errno;
+                    crossDevice = errno == EXDEV;
+                }
+
+                std::shared_ptr<DirPair> root = std::make_shared<DirPair>(
+                    *this, nullptr, "", job.Source, job.Destination
+                );
+
+                int fd = open(job.Source, O_RDONLY | O_DIRECTORY);
+                if (fd < 0) return errno;
+
+                if (fstat(fd, &root->st) != 0 || (root->source = fdopendir(fd)) == nullptr) {
+                    int error = errno;
+                    close(fd);
+                    return error;
+                }
+
+                if (mkdir(job.Destination, 0700) != 0 && errno != EEXIST) return errno;
+
+                root->destination = open(job.Destination, O_RDONLY | O_DIRECTORY);
+                if (root->destination < 0) return errno;
+
+                struct stat destination;
+                if (fstat(root->destination, &destination) != 0) return errno;
+                destinationDevice = destination.st_dev;
+
+                pool.Push(0, [this, root](size_t worker) { Walk(root, worker); });
+                root = nullptr;
+
+                pool.Run();
+                return failure;
+            }
+
+            bool Renamed() const { return renamed; }
+            double Files() const { return (double) filesDone; }
+            double Bytes() const { return (double) bytesDone; }
+
+            // Called once per directory, when it is complete
+            void Finish(DirPair& dir) {
+                if (dir.destination < 0 || Failed()) return;
+
+                struct timespec times[2];
+                getTimes(dir.st, times);
+
+                if (fchmod(dir.destination, dir.st.st_mode & 07777) != 0 ||
+                    futimens(dir.destination, times) != 0) {
+                    Fail(errno);
+                    return;
+                }
+
+                if (move) {
+                    int removed = dir.parent
+                        ? unlinkat(dir.parent->sourceFd(), dir.name.c_str(), AT_REMOVEDIR)
+                        : rmdir(dir.sourcePath.c_str());
+                    if (removed != 0) Fail(errno);
+                }
+            }
+
+        private:
+            const Job& job;
+            const bool move;
+            Reporter& reporter;
+
+            WorkPool pool;
+
+            // the walk runs at full concurrency, only the copies queue up
+            DeviceStreams streams;
+            dev_t destinationDevice;
+
+            std::atomic<int> failure;
+            std::atomic<bool> crossDevice;
+            bool renamed;
+
+            std::atomic<size_t> filesFound;
+            std::atomic<size_t> filesDone;
+            std::atomic<uint64_t> bytesDone;
+
+            // For dedup: the copy of each source file with several
+            // links, by device and inode, once the first of its paths
+            // has been through CopyFileAt().
+            struct SharedCopy {
+                std::string path;
+                bool done;
+                bool copied;
+            };
+            std::map<std::pair<dev_t, ino_t>, SharedCopy> copies;
+            std::mutex copiesMutex;
+            std::condition_variable copiesDone;
+
+            bool Failed() const { return failure != 0; }
+
+            void Fail(int error) {
+                int none = 0;
+                failure.compare_exchange_strong(none, error);
+            }
+
+            void Report() {
+                if (job.UpdateProgress) {
+                    reporter.UpdateFiles((double) filesDone, (double) filesFound, (double) bytesDone);
+                }
+            }
+
+            // Whether another path of the file st describes has been
+            // copied, to copy.  The first path to ask gets false, and
+            // must call Shared() once it is done; the others wait for it.
+            bool FindCopy(const struct stat& st, const std::string& destination, std::string& copy) {
+                std::unique_lock<std::mutex> lock(copiesMutex);
+
+                auto first = copies.emplace(
+                    std::make_pair(st.st_dev, st.st_ino), SharedCopy{ destination, false, false }
+                );
+                if (first.second) return false;
+
+                SharedCopy& shared = first.first->second;
+                copiesDone.wait(lock, [&shared] { return shared.done; });
+                if (!shared.copied) return false;
+
+                copy = shared.path;
+                return true;
+            }
+
+            void Shared(const struct stat& st, bool copied) {
+                std::lock_guard<std::mutex> lock(copiesMutex);
+
+                SharedCopy& shared = copies[std::make_pair(st.st_dev, st.st_ino)];
+                shared.done = true;
+                shared.copied = copied;
+                copiesDone.notify_all();
+            }
+
+            // Tries to move an entry with a single rename.  Returns true
+            // if that worked; false means it has to be copied instead.
+            bool Rename(DirPair& dir, const char* name) {
+                if (!move || crossDevice) return false;
+
+                if (renameat(dir.sourceFd(), name, dir.destination, name) == 0) return true;
+
+                if (errno == EXDEV) crossDevice = true;
+                else if (errno != EEXIST && errno != ENOTEMPTY) Fail(errno);
+                return false;
+            }
+
+            void Walk(std::shared_ptr<DirPair> dir, size_t worker) {
+                struct dirent* entry;
+
+                // readdir() is only ever called here, by a single task,
+                // so its state is safe; other tasks only use the fd.
+                while (!Failed() && (entry = readdir(dir->source)) != nullptr) {
+                    const char* name = entry->d_name;
+                    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+                    unsigned char type = entry->d_type;
+                    if (type == DT_UNKNOWN) {
+                        struct stat st;
+                        if (fstatat(dir->sourceFd(), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                            Fail(errno);
+                            return;
+                        }
+                        type = S_ISDIR(st.st_mode) ? DT_DIR
+                             : S_ISREG(st.st_mode) ? DT_REG
+                             : S_ISLNK(st.st_mode) ? DT_LNK
+                             : DT_UNKNOWN;
+                    }
+
+                    if (type == DT_DIR) {
+                        if (Rename(*dir, name)) continue;
+
+                        std::string child = name;
+                        pool.Push(worker, [this, dir, child](size_t worker) {
+                            Enter(dir, child, worker);
+                        });
+                    }
+                    else if (type == DT_REG) {
+                        if (Rename(*dir, name)) continue;
+
+                        filesFound++;
+                        std::string file = name;
+                        pool.Push(worker, [this, dir, file](size_t) {
+                            CopyFileAt(*dir, file);
+                        });
+                    }
+                    else if (type == DT_LNK) {
+                        if (Rename(*dir, name)) continue;
+                        CopyLinkAt(*dir, name);
+                    }
+                    // sockets, fifos and devices are left alone
+                }
+            }
+
+            void Enter(std::shared_ptr<DirPair> parent, const std::string& name, size_t worker) {
+                if (Failed()) return;
+
+                std::shared_ptr<DirPair> dir = std::make_shared<DirPair>(
+                    *this, parent, name,
+                    parent->sourcePath + "/" + name, parent->destinationPath + "/" + name
+                );
+
+                int fd = openat(parent->sourceFd(), name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+                if (fd < 0) {
+                    Fail(errno);
+                    return;
+                }
+                if (fstat(fd, &dir->st) != 0 || (dir->source = fdopendir(fd)) == nullptr) {
+                    Fail(errno);
+                    close(fd);
+                    return;
+                }
+
+                // owner-only until Finish() applies the real mode
+                if (mkdirat(parent->destination, name.c_str(), 0700) != 0 && errno != EEXIST) {
+                    Fail(errno);
+                    return;
+                }
+
+                dir->destination = openat(parent->destination, name.c_str(), O_RDONLY | O_DIRECTORY);
+                if (dir->destination < 0) {
+                    Fail(errno);
+                    return;
+                }
+
+                Walk(dir, worker);
+            }
+
+            void CopyFileAt(DirPair& dir, const std::string& name) {
+                if (Failed()) return;
+                if (job.Checkpoint() == -1) {
+                    Fail(errno);
+                    return;
+                }
+
+                // the mode given to openat() goes through the umask, so
+                // Copy() sets it again along with the times
+                const Job file = job.ForTreeFile(
+                    dir.sourcePath + "/" + name, dir.destinationPath + "/" + name
+                );
+
+                int in = openat(dir.sourceFd(), name.c_str(), O_RDONLY | O_NOFOLLOW);
+                if (in < 0) {
+                    Fail(errno);
+                    return;
+                }
+
+                struct stat st;
+                if (fstat(in, &st) != 0) {
+                    Fail(errno);
+                    close(in);
+                    return;
+                }
+
+                struct stat existing;
+                if (job.Incremental && !move &&
+                    fstatat(dir.destination, name.c_str(), &existing, AT_SYMLINK_NOFOLLOW) == 0 &&
+                    UpToDate(job, st, existing)) {
+                    close(in);
+
+                    filesDone++;
+                    bytesDone += st.st_size;
+                    Report();
+                    return;
+                }
+
+                // hard links in the source stay links, or reflinks, in
+                // the copy; a move renames each path anyway
+                const bool linked = job.Dedup != DEDUP_NONE && !move && st.st_nlink > 1;
+                std::string copy;
+                if (linked && FindCopy(st, file.Destination, copy)) {
+                    close(in);
+
+                    Stats stats;
+                    int error = CopyDuplicate(copy, file, reporter, stats);
+                    Telemetry::Shared().Record(stats, error);
+                    if (error != 0) {
+                        Fail(error);
+                        return;
+                    }
+
+                    filesDone++;
+                    bytesDone += st.st_size;
+                    Report();
+                    return;
+                }
+
+                StagedFile staged(dir.destination, name);
+
+                int out = job.Atomic
+                    ? staged.Open(OutputAccess(job), st.st_mode & 0777)
+                    : openat(dir.destination, name.c_str(),
+                             OutputAccess(job) | O_CREAT | OutputTruncate(job), st.st_mode & 0777);
+                if (out < 0) {
+                    Fail(errno);
+                    if (linked) Shared(st, false);
+                    close(in);
+                    return;
+                }
+
+                Stats stats;
+                streams.Acquire(st.st_dev, destinationDevice);
+                int error = Copy(in, out, st, file, reporter, stats, false, job.Atomic ? &staged : nullptr);
+                streams.Release(st.st_dev, destinationDevice);
+                Telemetry::Shared().Record(stats, error);
+                if (linked) Shared(st, error == 0);
+                if (error != 0) {
+                    Fail(error);
+                    return;
+                }
+
+                if (move && unlinkat(dir.sourceFd(), name.c_str(), 0) != 0) {
+                    Fail(errno);
+                    return;
+                }
+
+                filesDone++;
+                bytesDone += st.st_size;
+                Report();
+            }
+
+            void CopyLinkAt(DirPair& dir, const char* name) {
+                struct stat st;
+                char target[PATH_MAX + 1];
+
+                if (fstatat(dir.sourceFd(), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    Fail(errno);
+                    return;
+                }
+
+                ssize_t length = readlinkat(dir.sourceFd(), name, target, PATH_MAX);
+                if (length < 0) {
+                    Fail(errno);
+                    return;
+                }
+                target[length] = '\0';
+
+                int linked = symlinkat(target, dir.destination, name);
+                if (linked != 0 && errno == EEXIST &&
+                    unlinkat(dir.destination, name, 0) == 0) {
+                    linked = symlinkat(target, dir.destination, name);
+                }
+
+                struct timespec times[2];
+                getTimes(st, times);
+
+                if (linked != 0 ||
+                    utimensat(dir.destination, name, times, AT_SYMLINK_NOFOLLOW) != 0) {
+                    Fail(errno);
+                    return;
+                }
+
+                if (move && unlinkat(dir.sourceFd(), name, 0) != 0) {
+                    Fail(errno);
+                }
+            }
+    };
+
+    DirPair::~DirPair() {
+        copier.Finish(*this);
+
+        if (source != nullptr) closedir(source);
+        if (destination >= 0) close(destination);
+    }
+#endif
+
+    // CopyPath or MovePath
+    typedef int (*Operation)(const Job& job, Reporter& reporter, Stats& stats);
+
+    // (resolver, fulfilled, value); created once, when the module loads
+    Nan::Persistent<v8::Function> settle;
+
+    NAN_METHOD(Settle) {
+        v8::Local<v8::Promise::Resolver> resolver = info[0].As<v8::Promise::Resolver>();
+        if (info[1]->IsTrue()) {
+            resolver->Resolve(Nan::GetCurrentContext(), info[2]).FromMaybe(false);
+        }
+        else {
+            resolver->Reject(Nan::GetCurrentContext(), info[2]).FromMaybe(false);
+        }
+    }
+
+    template<size_t N>
+    void SetNumbers(v8::Local<v8::Object> object, const std::pair<const char*, double> (&fields)[N]) {
+        for (const auto& field : fields) {
+            Nan::Set(object, Nan::New<v8::String>(field.first).ToLocalChecked(), Nan::New<v8::Number>(field.second));
+        }
+    }
+
+    // The steps of a transfer, in milliseconds
+    v8::Local<v8::Object> Times(double open, double transfer, double flush, double verify, double rename) {
+        v8::Local<v8::Object> times = Nan::New<v8::Object>();
+        const std::pair<const char*, double> fields[] = {
+            { "open", open },
+            { "transfer", transfer },
+            { "flush", flush },
+            { "verify", verify },
+            { "rename", rename },
+        };
+        SetNumbers(times, fields);
+        return times;
+    }
+
+    // Base for the workers that run on the libuv threadpool.  Progress
+    // is rate limited here to one update per ProgressInterval, and nan
+    // coalesces whatever still gets through: if the main thread falls
+    // behind only the most recent update is delivered, never a backlog.
+    class TransferWorker
+        : public Nan::AsyncProgressWorkerBase<Progress>, protected Reporter {
+        public:
+            // nan only reports progress while there is a callback
+            // object, so promise calls share an empty one.
+            TransferWorker(const Args& args, const char* name)
+                : Nan::AsyncProgressWorkerBase<Progress>(
+                      args.ReturnsPromise ? &EmptyCallback() : new Nan::Callback(args.ResultCallback), name),
+                  job(args), interval(args.ProgressInterval),
+                  error(0), execution(nullptr),
+                  last{ -1, -1, -1 }, delivered(-1)
+            {
+                if (job.UpdateProgress) {
+                    progressCallback.Reset(args.ProgressCallback);
+                }
+
+                if (args.ReturnsPromise) {
+                    SaveToPersistent("resolver",
+                        v8::Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked());
+                }
+            }
+
+            v8::Local<v8::Promise> GetPromise() {
+                return GetFromPersistent("resolver").As<v8::Promise::Resolver>()->GetPromise();
+            }
+
+            void Execute(const ExecutionProgress& progress) override {
+                execution = &progress;
+                error = Run();
+                execution = nullptr;
+
+                if (error) SetErrorMessage(strerror(error));
+            }
+
+            void HandleProgressCallback(const Progress* data, size_t count) override {
+                Nan::HandleScope scope;
+
+                if (data == nullptr || count == 0) return;
+                SendProgress(*data);
+            }
+
+        protected:
+            const Job job;
+
+            // Does the actual work; returns 0 or an errno value
+            virtual int Run() = 0;
+
+            void Update(double completed, double total) override {
+                std::lock_guard<std::mutex> lock(publishing);
+                Publish(Progress{ completed, total, -1 });
+            }
+
+            void UpdateFiles(double done, double total, double bytes) override {
+                std::lock_guard<std::mutex> lock(publishing);
+                Publish(Progress{ done, total, bytes });
+            }
+
+            // nan may drop the last progress event if the work
+            // completes first, so make sure it gets delivered.
+            void FlushProgress() {
+                if (job.UpdateProgress && last.completed != delivered) {
+                    SendProgress(last);
+                }
+            }
+
+            void HandleErrorCallback() override {
+                Nan::HandleScope scope;
+
+                LocalValue argv[2] = {
+                    Nan::New<v8::String>(ErrorMessage()).ToLocalChecked(),
+                    Nan::False()
+                };
+                Deliver(2, argv, Nan::ErrnoException(error));
+            }
+
+            // Passes the outcome to the result callback, or settles the
+            // promise with `value` if the call returned one.  argv[0] is
+            // the callback's error argument, null on success.
+            void Deliver(int argc, LocalValue argv[], LocalValue value) {
+                if (!callback->IsEmpty()) {
+                    callback->Call(argc, argv, async_resource);
+                    return;
+                }
+
+                // Settled through a JS call so that the promise's
+                // reactions run as soon as this callback returns.
+                LocalValue settleArgv[3] = {
+                    GetFromPersistent("resolver"),
+                    Nan::New<v8::Boolean>(argv[0]->IsNull()),
+                    value
+                };
+                async_resource->runInAsyncScope(
+                    Nan::GetCurrentContext()->Global(), Nan::New(settle), 3, settleArgv
+                );
+
+                // nan deletes the callback once this returns, and the
+                // empty one is shared
+                callback = nullptr;
+            }
+
+            static v8::Local<v8::Object> Info(const Stats& stats) {
+                v8::Local<v8::Object> info = Nan::New<v8::Object>();
+                Nan::Set(info,
+                    Nan::New<v8::String>("engine").ToLocalChecked(),
+                    Nan::New<v8::String>(EngineName(stats.engine)).ToLocalChecked()
+                );
+                if (stats.written >= 0) {
+                    Nan::Set(info,
+                        Nan::New<v8::String>("written").ToLocalChecked(),
+                        Nan::New<v8::Number>(stats.written)
+                    );
+                }
+                if (stats.resumed >= 0) {
+                    Nan::Set(info,
+                        Nan::New<v8::String>("resumed").ToLocalChecked(),
+                        Nan::New<v8::Number>(stats.resumed)
+                    );
+                }
+                if (!stats.checksum.empty()) {
+                    Nan::Set(info,
+                        Nan::New<v8::String>("checksum").ToLocalChecked(),
+                        Nan::New<v8::String>(stats.checksum).ToLocalChecked()
+                    );
+                }
+
+                // bytes per second while the data was moving
+                const double bandwidth = stats.transferTime > 0 ? stats.bytes / (stats.transferTime / 1000) : 0;
+                const std::pair<const char*, double> fields[] = {
+                    { "bytes", stats.bytes },
+                    { "reads", stats.reads },
+                    { "writes", stats.writes },
+                    { "bandwidth", bandwidth },
+                };
+                SetNumbers(info, fields);
+
+                Nan::Set(info, Nan::New<v8::String>("times").ToLocalChecked(),
+                    Times(stats.openTime, stats.transferTime, stats.flushTime, stats.verifyTime, stats.renameTime));
+                return info;
+            }
+
+        private:
+            Nan::Callback progressCallback;
+            const std::chrono::duration<double, std::milli> interval;
+
+            // for the calls that return a promise, made and only ever
+            // touched on the main thread
+            static Nan::Callback& EmptyCallback() {
+                static Nan::Callback* empty = new Nan::Callback();
+                return *empty;
+            }
+
+            int error;
+            const ExecutionProgress* execution;
+
+            std::mutex publishing;
+            Progress last;    // written by the worker thread
+            double delivered; // only touched on the main thread
+            std::chrono::steady_clock::time_point published;
+
+            // Remembers every update, but only passes one on to the
+            // main thread every ProgressInterval.  The final one always
+            // goes through, and FlushProgress() catches anything else
+            // that was held back.
+            void Publish(const Progress& progress) {
+                last = progress;
+
+                const auto now = std::chrono::steady_clock::now();
+                const bool final = progress.completed >= progress.total;
+                if (!final && now - published < interval) return;
+
+                published = now;
+                execution->Send(&last, 1);
+            }
+
+            void SendProgress(const Progress& p) {
+                if (progressCallback.IsEmpty()) return;
+
+                LocalValue argv[3] = {
+                    Nan::New<v8::Number>(p.completed),
+                    Nan::New<v8::Number>(p.total),
+                    Nan::New<v8::Number>(p.bytes),
+                };
+                progressCallback.Call(p.bytes < 0 ? 2 : 3, argv, async_resource);
+                delivered = p.completed;
+            }
+    };
+
+    // A single copy or move
+    class FileWorker : public TransferWorker {
+        public:
+            FileWorker(const Args& args, Operation operation, const char* name)
+                : TransferWorker(args, name), operation(operation) {}
+
+        protected:
+            int Run() override {
+                int error = operation(job, *this, stats);
+                Telemetry::Shared().Record(stats, error);
+                return error;
+            }
+
+            void HandleOKCallback() override {
+                Nan::HandleScope scope;
+
+                FlushProgress();
+
+                v8::Local<v8::Object> info = Info(stats);
+
+                LocalValue argv[3] = { Nan::Null(), Nan::True(), info };
+                Deliver(3, argv, info);
+            }
+
+        private:
+            const Operation operation;
+            Stats stats;
+    };
+
+    // Runs the files of a batch on a small pool of native threads, up
+    // to Concurrency of them at once, and reports progress in files.
+    class BatchWorker : public TransferWorker {
+        public:
+            BatchWorker(const Args& args, Operation operation, const char* name)
+                : TransferWorker(args, name), operation(operation),
+                  files(args.Files), results(files.size()), originals(files.size()),
+                  scheduler(job), filesDone(0), bytesDone(0) {}
+
+        protected:
+            int Run() override {
+                // Files whose devices can't be found out are queued
+                // together, and fail when their turn comes.
+                std::vector<struct stat> sources(files.size());
+                std::vector<bool> found(files.size());
+                std::vector<dev_t> from(files.size()), to(files.size());
+
+                std::map<std::string, dev_t> parents;
+                for (size_t i = 0; i < files.size(); i++) {
+                    found[i] = statPath(files[i].Source, sources[i]) == 0;
+                    from[i] = found[i] ? sources[i].st_dev : 0;
+
+                    const std::string parent = Parent(files[i].Destination);
+                    auto known = parents.find(parent);
+                    if (known == parents.end()) {
+                        struct stat destination;
+                        dev_t device = statPath(parent, destination) == 0 ? destination.st_dev : 0;
+                        known = parents.emplace(parent, device).first;
+                    }
+                    to[i] = known->second;
+                }
+
+                if (job.Dedup != DEDUP_NONE && operation == CopyPath) {
+                    FindDuplicates(job, files, sources, found, originals);
+                }
+                else {
+                    for (size_t i = 0; i < files.size(); i++) originals[i] = i;
+                }
+
+                // duplicates wait for all the originals to be copied
+                size_t duplicates = 0;
+                for (size_t i = 0; i < files.size(); i++) {
+                    if (originals[i] == i) scheduler.Add(i, from[i], to[i]);
+                    else duplicates++;
+                }
+                DrainAll(files.size() - duplicates);
+
+                if (duplicates > 0) {
+                    for (size_t i = 0; i < files.size(); i++) {
+                        if (originals[i] != i) scheduler.Add(i, from[i], to[i]);
+                    }
+                    DrainAll(duplicates);
+                }
+
+                if (job.Durability != DURABILITY_BATCH) return 0;
+
+                std::vector<std::string> dirs;
+                for (size_t i = 0; i < files.size(); i++) {
+                    if (results[i].error == 0) dirs.push_back(Parent(files[i].Destination));
+                }
+                return SyncDirectories(dirs);
+            }
+
+            void HandleOKCallback() override {
+                Nan::HandleScope scope;
+
+                FlushProgress();
+
+                size_t failed = 0;
+                v8::Local<v8::Array> list = Nan::New<v8::Array>((int) files.size());
+
+                for (size_t i = 0; i < files.size(); i++) {
+                    v8::Local<v8::Object> entry = Info(results[i].stats);
+                    Nan::Set(entry,
+                        Nan::New<v8::String>("src").ToLocalChecked(),
+                        Nan::New<v8::String>(files[i].Source).ToLocalChecked()
+                    );
+                    Nan::Set(entry,
+                        Nan::New<v8::String>("dst").ToLocalChecked(),
+                        Nan::New<v8::String>(files[i].Destination).ToLocalChecked()
+                    );
+
+                    LocalValue error = Nan::Null();
+                    if (results[i].error != 0) {
+                        error = Nan::New<v8::String>(strerror(results[i].error)).ToLocalChecked();
+                        failed++;
+                    }
+                    Nan::Set(entry, Nan::New<v8::String>("error").ToLocalChecked(), error);
+
+                    Nan::Set(list, (uint32_t) i, entry);
+                }
+
+                LocalValue summary = Nan::Null();
+                LocalValue value = list;
+                if (failed > 0) {
+                    std::string text = std::to_string(failed) + " of " +
+                        std::to_string(files.size()) + " files failed";
+                    summary = Nan::New<v8::String>(text).ToLocalChecked();
+
+                    // promises reject, with the results still attached
+                    v8::Local<v8::Object> error = v8::Exception::Error(summary.As<v8::String>()).As<v8::Object>();
+                    Nan::Set(error, Nan::New<v8::String>("results").ToLocalChecked(), list);
+                    value = error;
+                }
+
+                LocalValue argv[2] = { summary, list };
+                Deliver(2, argv, value);
+            }
+
+        private:
+            struct Result {
+                int error;
+                Stats stats;
+            };
+
+            const Operation operation;
+            const std::vector<Paths> files;
+            std::vector<Result> results;
+
+            // for dedup, the earlier file each one shares a source with,
+            // or its own index
+            std::vector<size_t> originals;
+
+            BatchScheduler scheduler;
+
+            std::mutex mutex;
+            size_t filesDone;
+            double bytesDone;
+
+            // Per-file progress is never asked for, so this is only here
+            // to satisfy the operation's signature.
+            class Silent : public Reporter {
+                public:
+                    void Update(double, double) override {}
+            };
+
+            // Runs the queued files on up to job.Concurrency threads,
+            // until count of them are done.
+            void DrainAll(size_t count) {
+                const size_t threads = std::min((size_t) job.Concurrency, count);
+
+                std::vector<std::thread> pool;
+                for (size_t i = 1; i < threads; i++) {
+                    pool.emplace_back(&BatchWorker::Drain, this);
+                }
+                Drain();
+
+                for (std::thread& thread : pool) thread.join();
+            }
+
+            void Drain() {
+                Silent silent;
+
+                size_t index;
+                dev_t source, destination;
+                while (scheduler.Next(index, source, destination)) {
+                    const Job file = job.ForFile(files[index].Source, files[index].Destination);
+                    const size_t original = originals[index];
+                    Result& result = results[index];
+                    if (original != index && results[original].error == 0) {
+                        result.error = CopyDuplicate(files[original].Destination, file, silent, result.stats);
+                    }
+                    else {
+                        result.error = operation(file, silent, result.stats);
+                    }
+                    scheduler.Release(source, destination);
+                    Telemetry::Shared().Record(result.stats, result.error);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    filesDone++;
+                    bytesDone += result.stats.bytes;
+                    if (job.UpdateProgress) {
+                        UpdateFiles((double) filesDone, (double) files.size(), bytesDone);
+                    }
+                }
+            }
+    };
+
+    // copyDir or moveDir
+    class DirWorker : public TransferWorker {
+        public:
+            DirWorker(const Args& args, bool move, const char* name)
+                : TransferWorker(args, name), move(move),
+                  renamed(false), files(0), bytes(0) {}
+
+        protected:
+            int Run() override {
+#ifdef _WIN32
+                return ENOSYS;
+#else
+                TreeCopier copier(job, move, *this);
+                int error = copier.Run();
+                if (error == 0 && job.Durability == DURABILITY_BATCH) {
+                    error = SyncDirectories({ job.Destination });
+                }
+
+                renamed = copier.Renamed();
+                files = copier.Files();
+                bytes = copier.Bytes();
+                return error;
+#endif
+            }
+
+            void HandleOKCallback() override {
+                Nan::HandleScope scope;
+
+                FlushProgress();
+
+                v8::Local<v8::Object> info = Nan::New<v8::Object>();
+                Nan::Set(info, Nan::New<v8::String>("files").ToLocalChecked(), Nan::New<v8::Number>(files));
+                Nan::Set(info, Nan::New<v8::String>("bytes").ToLocalChecked(), Nan::New<v8::Number>(bytes));
+                Nan::Set(info, Nan::New<v8::String>("renamed").ToLocalChecked(), Nan::New<v8::Boolean>(renamed));
+
+                LocalValue argv[3] = { Nan::Null(), Nan::True(), info };
+                Deliver(3, argv, info);
+            }
+
+        private:
+            const bool move;
+
+            bool renamed;
+            double files;
+            double bytes;
+    };
+
+    // Starts the worker, returning its promise if the call wants one
+    void Queue(const Nan::FunctionCallbackInfo<v8::Value>& info, const Args& args,
+               TransferWorker* worker) {
+        if (args.ReturnsPromise) {
+            info.GetReturnValue().Set(worker->GetPromise());
+        }
+        Nan::AsyncQueueWorker(worker);
+    }
+
+    NAN_METHOD(Copy) {
+        Args args(info);
+        if (!args.Valid) return;
+        args.SingleFile();
+
+        Queue(info, args, new FileWorker(args, CopyPath, "nativefs:copy"));
+    }
+
+    NAN_METHOD(Move) {
+        Args args(info);
+        if (!args.Valid) return;
+        args.SingleFile();
+
+        Queue(info, args, new FileWorker(args, MovePath, "nativefs:move"));
+    }
+
+    NAN_METHOD(CopyMany) {
+        Args args(info, /* batch: */ true);
+        if (!args.Valid) return;
+
+        Queue(info, args, new BatchWorker(args, CopyPath, "nativefs:copyMany"));
+    }
+
+    NAN_METHOD(MoveMany) {
+        Args args(info, /* batch: */ true);
+        if (!args.Valid) return;
+
+        Queue(info, args, new BatchWorker(args, MovePath, "nativefs:moveMany"));
+    }
+
+    NAN_METHOD(CopyDir) {
+        Args args(info);
+        if (!args.Valid) return;
+
+        Queue(info, args, new DirWorker(args, /* move: */ false, "nativefs:copyDir"));
+    }
+
+    NAN_METHOD(MoveDir) {
+        Args args(info);
+        if (!args.Valid) return;
+
+        Queue(info, args, new DirWorker(args, /* move: */ true, "nativefs:moveDir"));
+    }
+
+    // bufferPool([{ capacity, limit }]) sets the shared buffer pool's
+    // sizes, in bytes, and returns its counters
+    v8::Local<v8::Object> PoolCounters(const BufferPool::Counters& counters) {
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        const std::pair<const char*, double> fields[] = {
+            { "hits", counters.hits },
+            { "misses", counters.misses },
+            { "waits", counters.waits },
+            { "pooled", counters.pooled },
+            { "lent", counters.lent },
+            { "capacity", counters.capacity },
+            { "limit", counters.limit },
+        };
+        SetNumbers(result, fields);
+        return result;
+    }
+
+    NAN_METHOD(ConfigureBufferPool) {
+        BufferPool& pool = BufferPool::Shared();
+        BufferPool::Counters counters = pool.Stats();
+
+        if (info.Length() > 0 && !info[0]->IsUndefined()) {
+            if (!info[0]->IsObject()) {
+                Nan::ThrowTypeError("options must be an object");
+                return;
+            }
+            v8::Local<v8::Object> options = info[0].As<v8::Object>();
+
+            double sizes[2] = { counters.capacity, counters.limit };
+            const char* names[2] = { "capacity", "limit" };
+            for (int i = 0; i < 2; i++) {
+                LocalValue value = option(options, names[i]);
+                if (value->IsUndefined()) continue;
+
+                double bytes = value->IsNumber() ? Nan::To<double>(value).FromJust() : -1;
+                if (!(bytes >= 0 && bytes <= (double) SIZE_MAX)) {
+                    Nan::ThrowRangeError((std::string(names[i]) + " must be a number of bytes").c_str());
+                    return;
+                }
+                sizes[i] = bytes;
+            }
+
+            pool.Configure((size_t) sizes[0], (size_t) sizes[1]);
+            counters = pool.Stats();
+        }
+
+        info.GetReturnValue().Set(PoolCounters(counters));
+    }
+
+    // throttle([{ bandwidth, iops }]) sets the limits every copy in the
+    // process shares, 0 for none, and returns them
+    NAN_METHOD(ConfigureThrottle) {
+        Throttle& throttle = Throttle::Global();
+
+        if (info.Length() > 0 && !info[0]->IsUndefined()) {
+            if (!info[0]->IsObject()) {
+                Nan::ThrowTypeError("options must be an object");
+                return;
+            }
+            v8::Local<v8::Object> options = info[0].As<v8::Object>();
+
+            double rates[2] = { throttle.Bandwidth(), throttle.Iops() };
+            const char* names[2] = { "bandwidth", "iops" };
+            for (int i = 0; i < 2; i++) {
+                LocalValue value = option(options, names[i]);
+                if (value->IsUndefined()) continue;
+
+                double rate = value->IsNumber() ? Nan::To<double>(value).FromJust() : -1;
+                if (!(rate >= 0 && std::isfinite(rate))) {
+                    Nan::ThrowRangeError((std::string(names[i]) + " must be a rate per second").c_str());
+                    return;
+                }
+                rates[i] = rate;
+            }
+
+            throttle.Configure(rates[0], rates[1]);
+        }
+
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        const std::pair<const char*, double> fields[] = {
+            { "bandwidth", throttle.Bandwidth() },
+            { "iops", throttle.Iops() },
+        };
+        SetNumbers(result, fields);
+        info.GetReturnValue().Set(result);
+    }
+
+    // () -> the process-wide Telemetry totals
+    NAN_METHOD(Statistics) {
+        const Telemetry::Totals totals = Telemetry::Shared().Get();
+
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        const std::pair<const char*, double> fields[] = {
+            { "files", totals.files },
+            { "failures", totals.failures },
+            { "bytes", totals.bytes },
+            { "reads", totals.reads },
+            { "writes", totals.writes },
+        };
+        SetNumbers(result, fields);
+
+        Nan::Set(result, Nan::New<v8::String>("times").ToLocalChecked(),
+            Times(totals.openTime, totals.transferTime, totals.flushTime, totals.verifyTime, totals.renameTime));
+
+        v8::Local<v8::Object> engines = Nan::New<v8::Object>();
+        for (int engine = ENGINE_BUFFERED; engine < ENGINE_COUNT; engine++) {
+            Nan::Set(engines,
+                Nan::New<v8::String>(EngineName((Engine) engine)).ToLocalChecked(),
+                Nan::New<v8::Number>(totals.engines[engine])
+            );
+        }
+        Nan::Set(result, Nan::New<v8::String>("engines").ToLocalChecked(), engines);
+
+        Nan::Set(result, Nan::New<v8::String>("bufferPool").ToLocalChecked(),
+            PoolCounters(BufferPool::Shared().Stats()));
+
+        info.GetReturnValue().Set(result);
+    }
+
+    NAN_METHOD(CreateController) {
+        info.GetReturnValue().Set(Controller::Create());
+    }
+
+    NAN_MODULE_INIT(InitAll) {
+        settle.Reset(Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Settle)).ToLocalChecked());
+        Controller::Init();
+
+        Nan::Set(target,
+            Nan::New<v8::String>("copy").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Copy)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("move").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Move)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("copyMany").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CopyMany)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("moveMany").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(MoveMany)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("copyDir").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CopyDir)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("moveDir").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(MoveDir)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("bufferPool").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(ConfigureBufferPool)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("controller").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(CreateController)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("throttle").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(ConfigureThrottle)).ToLocalChecked()
+        );
+        Nan::Set(target,
+            Nan::New<v8::String>("stats").ToLocalChecked(),
+            Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Statistics)).ToLocalChecked()
+        );
+    }
+
+    NODE_MODULE(native_fs, InitAll)
+}  // namespace NativeFS
+
+#ifdef _WIN32
+#undef open
+#undef read
+#undef write
+#undef close
+
+#undef O_RDONLY
+#undef O_WRONLY
+#undef O_RDWR
+#undef O_CREAT
+#undef O_TRUNC
+#undef O_EXCL
+
+#undef AT_FDCWD
 
 #undef stat
 #undef fstat
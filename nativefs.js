@@ -3,13 +3,86 @@
 
   var native_fs = require('./build/Release/native_fs');
 
+  // The native functions are exported as they are; wrapping them would
+  // only add a call per operation.
   module.exports = {};
-  module.exports.copy = function() {
-    return native_fs.copy.apply(null, arguments);
-  };
+  module.exports.copy = native_fs.copy;
+  module.exports.move = native_fs.move;
+  module.exports.copyMany = native_fs.copyMany;
+  module.exports.moveMany = native_fs.moveMany;
+  module.exports.copyDir = native_fs.copyDir;
+  module.exports.moveDir = native_fs.moveDir;
+  module.exports.bufferPool = native_fs.bufferPool;
+  module.exports.controller = native_fs.controller;
+  module.exports.throttle = native_fs.throttle;
+  module.exports.stats = native_fs.stats;
+
+  // Turns the progress of a promise-returning call into an async
+  // iterable.  `start` is called with the onProgress function to pass
+  // on, and must return the call's promise:
+  //
+  //   var copying = nativefs.progress(function(onProgress) {
+  //     return nativefs.copy(a, b, { onProgress: onProgress });
+  //   });
+  //   for await (const p of copying) console.log(p.completed, p.total);
+  //   const info = await copying.result;
+  //
+  // Like the callbacks, the iterator only ever holds the most recent
+  // update: a slow consumer skips values instead of building a backlog.
+  module.exports.progress = function(start) {
+    var latest = null;
+    var waiting = []; // next() calls not answered yet, oldest first
+    var finished = false;
+    var failure = null;
+
+    function wake() {
+      while (waiting.length > 0) {
+        if (latest !== null) {
+          var value = latest;
+          latest = null;
+          waiting.shift().resolve({ value: value, done: false });
+        }
+        else if (failure !== null) {
+          // rejects once; later calls see the end
+          var err = failure;
+          failure = null;
+          waiting.shift().reject(err);
+        }
+        else if (finished) {
+          waiting.shift().resolve({ value: undefined, done: true });
+        }
+        else {
+          return;
+        }
+      }
+    }
+
+    var result = start(function(completed, total, bytes) {
+      latest = { completed: completed, total: total };
+      if (bytes !== undefined) latest.bytes = bytes;
+      wake();
+    });
+
+    result.then(function() {
+      finished = true;
+      wake();
+    }, function(err) {
+      finished = true;
+      failure = err;
+      wake();
+    });
 
-  module.exports.move = function() {
-      return native_fs.move.apply(null, arguments);
+    var iterator = {
+      result: result,
+      next: function() {
+        return new Promise(function(resolve, reject) {
+          waiting.push({ resolve: resolve, reject: reject });
+          wake();
+        });
+      }
+    };
+    iterator[Symbol.asyncIterator] = function() { return iterator; };
+    return iterator;
   };
 
   return;
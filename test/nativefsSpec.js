@@ -2,20 +2,409 @@ var expect = require('chai').expect;
 var nativefs = require('../nativefs.js');
 var fs = require('fs');
 
+// io_uring arrived in Linux 5.1, and can be turned off with a sysctl
+function hasIoUring() {
+  if (process.platform !== 'linux') return false;
+  var version = require('os').release().split('.').map(Number);
+  if (version[0] < 5 || (version[0] === 5 && version[1] < 1)) return false;
+  try {
+    return fs.readFileSync('/proc/sys/kernel/io_uring_disabled', 'utf8').trim() === '0';
+  }
+  catch (e) {
+    return true;
+  }
+}
+
 describe('NativeFS', function() {
 
   it("should copy file with progress reports", function(done) {
     var progress_reported = false;
     nativefs.copy('./nativefs.js', 'copied.js', function(copied, total) {
       progress_reported = true;
-    }, function(err, result) {
+    }, function(err, result, info) {
       if (err) throw err;
       expect(result).equal(true);
       expect(progress_reported).equal(true);
+      expect(info.engine).to.be.a('string');
+      done();
+    });
+  });
+
+  it("should not block the event loop", function(done) {
+    var returned = false;
+    nativefs.copy('./nativefs.js', 'copied.js', function(err, result) {
+      if (err) throw err;
+      expect(returned).equal(true);
+      done();
+    });
+    returned = true;
+  });
+
+  it("should copy file with an explicit chunk size", function(done) {
+    nativefs.copy('./nativefs.js', 'chunked.js', { chunkSize: 7 }, function(err, result) {
+      if (err) throw err;
+      expect(fs.readFileSync('chunked.js', 'utf8'))
+        .equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      fs.unlinkSync('chunked.js');
+      done();
+    });
+  });
+
+  it("should copy file through the pipeline", function(done) {
+    nativefs.copy('./nativefs.js', 'piped.js', { pipeline: 2, chunkSize: 64 }, function(err, result, info) {
+      if (err) throw err;
+      expect(fs.readFileSync('piped.js', 'utf8'))
+        .equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      fs.unlinkSync('piped.js');
+      done();
+    });
+  });
+
+  it("should copy file with io_uring or fall back", function(done) {
+    nativefs.copy('./nativefs.js', 'uring.js', { engine: 'io_uring', queueDepth: 2, chunkSize: 100 }, function(err, result, info) {
+      if (err) throw err;
+      if (hasIoUring()) expect(info.engine).equal('io_uring');
+      expect(fs.readFileSync('uring.js', 'utf8'))
+        .equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      fs.unlinkSync('uring.js');
+      done();
+    });
+  });
+
+  // sysfs files claim 4096 bytes and hold a few, so the first read
+  // comes up short
+  it("should copy a file that is shorter than its size with io_uring", function() {
+    var blocks = fs.existsSync('/sys/block') ? fs.readdirSync('/sys/block') : [];
+    var source = blocks.length > 0 ? '/sys/block/' + blocks[0] + '/queue/rotational' : null;
+    if (source === null || !fs.existsSync(source)) this.skip();
+
+    return nativefs.copy(source, 'short.txt', { engine: 'io_uring' }).then(function() {
+      expect(fs.readFileSync('short.txt', 'utf8')).equal(fs.readFileSync(source, 'utf8'));
+      fs.unlinkSync('short.txt');
+    });
+  });
+
+  it("should copy file from a mapping", function(done) {
+    nativefs.copy('./nativefs.js', 'mapped.js', { engine: 'mmap' }, function(err, result, info) {
+      if (err) throw err;
+      expect(info.engine).equal('mmap');
+      expect(fs.readFileSync('mapped.js', 'utf8'))
+        .equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      fs.unlinkSync('mapped.js');
+      done();
+    });
+  });
+
+  it("should copy a large file in parallel ranges", function() {
+    var data = Buffer.alloc(17 * 1024 * 1024 + 1, 'nativefs');
+    fs.writeFileSync('large.bin', data);
+    return nativefs.copy('large.bin', 'large_copy.bin', { parallel: 4 }).then(function(info) {
+      // a filesystem that can reflink does that instead
+      expect(['parallel', 'reflink']).to.include(info.engine);
+      expect(fs.readFileSync('large_copy.bin').equals(data)).equal(true);
+      fs.unlinkSync('large.bin');
+      fs.unlinkSync('large_copy.bin');
+    });
+  });
+
+  it("should copy file around the page cache", function(done) {
+    nativefs.copy('./nativefs.js', 'direct.js', { cacheMode: 'direct' }, function(err, result, info) {
+      if (err) throw err;
+      expect(fs.readFileSync('direct.js', 'utf8'))
+        .equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      fs.unlinkSync('direct.js');
+      done();
+    });
+  });
+
+  it("should replace a file atomically", function() {
+    fs.writeFileSync('atomic.js', 'old');
+    return nativefs.copy('./nativefs.js', 'atomic.js', { atomic: true }).then(function() {
+      expect(fs.readFileSync('atomic.js', 'utf8'))
+        .equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      expect(fs.readdirSync('.').filter(function(name) {
+        return name.indexOf('.atomic.js.') === 0;
+      })).to.be.empty;
+      fs.unlinkSync('atomic.js');
+    });
+  });
+
+  it("should checksum the data it copies", function() {
+    var expected = require('crypto').createHash('sha256')
+      .update(fs.readFileSync('./nativefs.js')).digest('hex');
+    return nativefs.copy('./nativefs.js', 'hashed.js', { checksum: 'sha256', verify: true }).then(function(info) {
+      expect(info.checksum).equal(expected);
+      fs.unlinkSync('hashed.js');
+    });
+  });
+
+  it("should only write what changed", function() {
+    var original = fs.readFileSync('./nativefs.js', 'utf8');
+    fs.writeFileSync('incremental.js', original.slice(0, 100) + 'x' + original.slice(101));
+    return nativefs.copy('./nativefs.js', 'incremental.js', { incremental: true }).then(function(info) {
+      expect(info.engine).equal('incremental');
+      expect(fs.readFileSync('incremental.js', 'utf8')).equal(original);
+      return nativefs.copy('./nativefs.js', 'incremental.js', { incremental: true });
+    }).then(function(info) {
+      expect(info.written).equal(0);
+      fs.unlinkSync('incremental.js');
+    });
+  });
+
+  it("should copy a sparse file", function(done) {
+    var fd = fs.openSync('sparse.bin', 'w');
+    fs.writeSync(fd, 'data', 1024 * 1024);
+    fs.ftruncateSync(fd, 4 * 1024 * 1024);
+    fs.closeSync(fd);
+
+    nativefs.copy('sparse.bin', 'sparse_copy.bin', { engine: 'sparse', sparse: true }, function(completed, total) {
+      expect(total).equal(4 * 1024 * 1024);
+    }, function(err, result, info) {
+      if (err) throw err;
+      expect(info.engine).equal('sparse');
+      expect(fs.readFileSync('sparse_copy.bin').equals(fs.readFileSync('sparse.bin')))
+        .equal(true);
+      // the holes stayed holes
+      var st = fs.statSync('sparse_copy.bin');
+      expect(st.blocks * 512).below(st.size / 4);
+      fs.unlinkSync('sparse.bin');
+      fs.unlinkSync('sparse_copy.bin');
+      done();
+    });
+  });
+
+  it("should preallocate a copy without changing its size", function() {
+    var data = Buffer.alloc(3 * 1024 * 1024 + 1, 'nativefs');
+    fs.writeFileSync('dense.bin', data);
+    return nativefs.copy('dense.bin', 'preallocated.bin', { engine: 'buffered', preallocate: true }).then(function(info) {
+      expect(info.engine).equal('buffered');
+      var st = fs.statSync('preallocated.bin');
+      expect(st.size).equal(data.length);
+      expect(st.blocks * 512).to.be.at.least(data.length);
+      expect(fs.readFileSync('preallocated.bin').equals(data)).equal(true);
+      fs.unlinkSync('dense.bin');
+      fs.unlinkSync('preallocated.bin');
+    });
+  });
+
+  it("should not preallocate over a sparse copy's holes", function() {
+    var fd = fs.openSync('holes.bin', 'w');
+    fs.writeSync(fd, 'data', 2 * 1024 * 1024);
+    fs.ftruncateSync(fd, 8 * 1024 * 1024);
+    fs.closeSync(fd);
+    return nativefs.copy('holes.bin', 'holes_copy.bin', { sparse: true, preallocate: true }).then(function() {
+      var st = fs.statSync('holes_copy.bin');
+      expect(st.size).equal(8 * 1024 * 1024);
+      expect(st.blocks * 512).below(st.size / 4);
+      fs.unlinkSync('holes.bin');
+      fs.unlinkSync('holes_copy.bin');
+    });
+  });
+
+  it("should reject a bad preallocate option", function() {
+    expect(function() {
+      nativefs.copy('./nativefs.js', 'preallocated.js', { preallocate: 'yes' }, function() {});
+    }).to.throw(TypeError);
+  });
+
+  describe('FIFOs', function() {
+    var data = Buffer.alloc(1024 * 1024 + 1, 'nativefs');
+
+    beforeEach(function() {
+      require('child_process').execSync('mkfifo fifo');
+    });
+
+    // the pipe holds 64 KB at most, so the copy sees short reads
+    it("should copy from a FIFO", function() {
+      fs.createWriteStream('fifo').end(data);
+      return nativefs.copy('fifo', 'from_fifo.bin').then(function(info) {
+        expect(info.engine).equal('buffered'); // a FIFO has no size to go by
+        expect(fs.readFileSync('from_fifo.bin').equals(data)).equal(true);
+        fs.unlinkSync('from_fifo.bin');
+      });
+    });
+
+    // and here short writes
+    it("should copy to a FIFO", function() {
+      fs.writeFileSync('to_fifo.bin', data);
+      var received = [];
+      var reading = new Promise(function(resolve, reject) {
+        fs.createReadStream('fifo')
+          .on('data', function(chunk) { received.push(chunk); })
+          .on('end', resolve)
+          .on('error', reject);
+      });
+      return Promise.all([nativefs.copy('to_fifo.bin', 'fifo'), reading]).then(function() {
+        expect(Buffer.concat(received).equals(data)).equal(true);
+        expect(fs.statSync('fifo').isFIFO()).equal(true);
+        fs.unlinkSync('to_fifo.bin');
+      });
+    });
+
+    afterEach(function() {
+      fs.unlinkSync('fifo');
+    });
+  });
+
+  it("should reject a bad chunk size", function() {
+    expect(function() {
+      nativefs.copy('./nativefs.js', 'chunked.js', { chunkSize: -1 }, function() {});
+    }).to.throw(RangeError);
+  });
+
+  it("should copy a batch of files", function(done) {
+    var jobs = [
+      { src: './nativefs.js', dst: 'batch1.js' },
+      { src: './package.json', dst: 'batch2.json' },
+      { src: './does-not-exist', dst: 'batch3' }
+    ];
+    var files_reported = 0;
+    nativefs.copyMany(jobs, { concurrency: 2 }, function(copied, total) {
+      files_reported = copied;
+      expect(total).equal(3);
+    }, function(err, results) {
+      expect(err).to.be.a('string');
+      expect(results.length).equal(3);
+      expect(results[0].error).equal(null);
+      expect(results[1].error).equal(null);
+      expect(results[2].error).to.be.a('string');
+      expect(files_reported).equal(3);
+      fs.unlinkSync('batch1.js');
+      fs.unlinkSync('batch2.json');
       done();
     });
   });
 
+  it("should sync a batch once at the end", function() {
+    var jobs = [
+      { src: './nativefs.js', dst: 'synced1.js' },
+      { src: './package.json', dst: 'synced2.json' }
+    ];
+    return nativefs.copyMany(jobs, { durability: 'batch' }).then(function(results) {
+      results.forEach(function(result) {
+        expect(result.error).equal(null);
+        // nothing is flushed file by file where syncfs can do it later
+        if (process.platform === 'linux') expect(result.times.flush).to.be.below(1);
+      });
+      fs.unlinkSync('synced1.js');
+      fs.unlinkSync('synced2.json');
+    });
+  });
+
+  it("should reject a bad rotational concurrency", function() {
+    expect(function() {
+      nativefs.copyMany([], { rotationalConcurrency: 0 }, function() {});
+    }).to.throw(RangeError);
+  });
+
+  it("should link duplicate sources in a batch", function() {
+    var jobs = [
+      { src: './nativefs.js', dst: 'dedup1.js' },
+      { src: './nativefs.js', dst: 'dedup2.js' }
+    ];
+    return nativefs.copyMany(jobs, { dedup: 'link' }).then(function(results) {
+      expect(results[1].engine).equal('link');
+      expect(fs.statSync('dedup2.js').ino).equal(fs.statSync('dedup1.js').ino);
+      fs.unlinkSync('dedup1.js');
+      fs.unlinkSync('dedup2.js');
+    });
+  });
+
+  it("should copy a directory tree", function(done) {
+    nativefs.copyDir('./test', 'test_copy', function(err, result, info) {
+      if (err) throw err;
+      expect(info.files).equal(fs.readdirSync('./test').length);
+      expect(fs.readFileSync('test_copy/nativefsSpec.js', 'utf8'))
+        .equal(fs.readFileSync('./test/nativefsSpec.js', 'utf8'));
+      nativefs.moveDir('test_copy', 'test_moved', function(err, result, info) {
+        if (err) throw err;
+        expect(info.renamed).equal(true);
+        expect(fs.existsSync('test_copy')).equal(false);
+        fs.readdirSync('test_moved').forEach(function(name) {
+          fs.unlinkSync('test_moved/' + name);
+        });
+        fs.rmdirSync('test_moved');
+        done();
+      });
+    });
+  });
+
+  it("should return a promise without a result callback", function() {
+    var progress_reported = false;
+    return nativefs.copy('./nativefs.js', 'promised.js', {
+      onProgress: function() { progress_reported = true; }
+    }).then(function(info) {
+      expect(info.engine).to.be.a('string');
+      expect(progress_reported).equal(true);
+      fs.unlinkSync('promised.js');
+    });
+  });
+
+  describe('progress interval', function() {
+    var data = Buffer.alloc(2 * 1024 * 1024, 'nativefs');
+
+    // Counts the callbacks of a copy in 16 KB chunks.  None of the
+    // bounds depend on how fast it runs.
+    function countUpdates(interval) {
+      var updates = 0, completed = 0;
+      return nativefs.copy('progress.bin', 'progress_copy.bin', {
+        engine: 'buffered', chunkSize: 16 * 1024,
+        progressInterval: interval,
+        onProgress: function(done) { updates++; completed = done; }
+      }).then(function() {
+        expect(completed).equal(data.length);
+        return updates;
+      });
+    }
+
+    before(function() {
+      fs.writeFileSync('progress.bin', data);
+    });
+
+    // at most one per 1% of the file, and the final one
+    it("should pass on at most an update per percent with an interval of 0", function() {
+      return countUpdates(0).then(function(updates) {
+        expect(updates).to.be.within(1, 101);
+      });
+    });
+
+    // the first one goes straight through, and the final one always does
+    it("should hold back every update but the first and last within the interval", function() {
+      return countUpdates(1e9).then(function(updates) {
+        expect(updates).to.be.within(1, 2);
+      });
+    });
+
+    after(function() {
+      fs.unlinkSync('progress.bin');
+      fs.unlinkSync('progress_copy.bin');
+    });
+  });
+
+  it("should answer every next() of a progress iterator", function() {
+    var copying = nativefs.progress(function(onProgress) {
+      return nativefs.copy('./nativefs.js', 'iterated.js', { onProgress: onProgress });
+    });
+    // asked for all at once, none of them waiting on the others
+    return Promise.all([copying.next(), copying.next(), copying.next()]).then(function(steps) {
+      steps.forEach(function(step) {
+        expect(step.done).to.be.a('boolean');
+      });
+      return copying.result;
+    }).then(function() {
+      fs.unlinkSync('iterated.js');
+    });
+  });
+
+  it("should reject the promise on failure", function() {
+    return nativefs.copy('./does-not-exist', 'promised.js').then(function() {
+      throw new Error('copy should have failed');
+    }, function(err) {
+      expect(err).to.be.an.instanceof(Error);
+      expect(err.code).equal('ENOENT');
+    });
+  });
+
   // since moved is a wrapper around copy, just ensure it's working
   // with an incomplete argument set (optional progress report).
   it("should move file", function(done) {
@@ -26,6 +415,149 @@ describe('NativeFS', function() {
     });
   });
 
+  it("should not move over an existing file unless told to", function() {
+    fs.writeFileSync('kept.js', 'kept');
+    return nativefs.move('moved.js', 'kept.js', { replace: false }).then(function() {
+      throw new Error('moved over kept.js');
+    }, function(err) {
+      expect(err.code).equal('EEXIST');
+      expect(fs.readFileSync('kept.js', 'utf8')).equal('kept');
+      fs.unlinkSync('kept.js');
+    });
+  });
+
+  it("should fail a cancelled copy and leave no destination", function() {
+    var controller = nativefs.controller();
+    controller.cancel();
+    return nativefs.copy('./nativefs.js', 'cancelled.js', { controller: controller }).then(function() {
+      throw new Error('copied anyway');
+    }, function(err) {
+      expect(err.code).equal('ECANCELED');
+      expect(fs.existsSync('cancelled.js')).equal(false);
+    });
+  });
+
+  it("should report timings and keep totals", function() {
+    var before = nativefs.stats();
+    return nativefs.copy('./nativefs.js', 'timed.js').then(function(info) {
+      expect(info.bytes).equal(fs.statSync('./nativefs.js').size);
+      expect(info.times.transfer).to.be.at.least(0);
+      expect(info.times.flush).to.be.at.least(0);
+      var after = nativefs.stats();
+      expect(after.files).equal(before.files + 1);
+      expect(after.bytes).equal(before.bytes + info.bytes);
+      expect(after.engines[info.engine]).equal(before.engines[info.engine] + 1);
+      fs.unlinkSync('timed.js');
+    });
+  });
+
+  it("should preserve timestamps and mode", function() {
+    fs.writeFileSync('old.js', 'old');
+    fs.chmodSync('old.js', parseInt('640', 8));
+    fs.utimesSync('old.js', 1000000000, 1000000000);
+    return nativefs.copy('old.js', 'preserved.js', { preserve: ['times', 'mode'] }).then(function() {
+      var st = fs.statSync('preserved.js');
+      expect(st.mtime.getTime()).equal(1000000000000);
+      expect(st.mode & parseInt('777', 8)).equal(parseInt('640', 8));
+      fs.unlinkSync('old.js');
+      fs.unlinkSync('preserved.js');
+    });
+  });
+
+  it("should make a resumable copy and remove its journal", function() {
+    return nativefs.copy('./nativefs.js', 'resumable.js', { resume: true }).then(function(info) {
+      expect(info.engine).equal('resumable');
+      expect(info.resumed).equal(0);
+      expect(fs.readFileSync('resumable.js', 'utf8')).equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      expect(fs.existsSync('.resumable.js.resume')).equal(false);
+      fs.unlinkSync('resumable.js');
+    });
+  });
+
+  it("should compress and decompress on the way", function() {
+    return nativefs.copy('./nativefs.js', 'compressed.js.gz', { compress: 'gzip' }).then(function(info) {
+      expect(info.engine).equal('gzip');
+      expect(info.written).equal(fs.statSync('compressed.js.gz').size);
+      return nativefs.copy('compressed.js.gz', 'decompressed.js', { decompress: 'gzip' });
+    }).then(function(info) {
+      expect(info.engine).equal('gunzip');
+      expect(fs.readFileSync('decompressed.js', 'utf8')).equal(fs.readFileSync('./nativefs.js', 'utf8'));
+      fs.unlinkSync('compressed.js.gz');
+      fs.unlinkSync('decompressed.js');
+    });
+  });
+
+  it("should compress a large file in chunks on several threads", function() {
+    var data = Buffer.alloc(9 * 1024 * 1024 + 1, 'nativefs');
+    fs.writeFileSync('uncompressed.bin', data);
+    return nativefs.copy('uncompressed.bin', 'compressed.bin.gz', { compress: 'gzip', compressionThreads: 3 }).then(function(info) {
+      expect(info.engine).equal('gzip');
+      expect(require('zlib').gunzipSync(fs.readFileSync('compressed.bin.gz')).equals(data)).equal(true);
+      fs.unlinkSync('uncompressed.bin');
+      fs.unlinkSync('compressed.bin.gz');
+    });
+  });
+
+  describe('throttling', function() {
+    var data = Buffer.alloc(512 * 1024, 'nativefs');
+
+    before(function() {
+      fs.writeFileSync('unthrottled.bin', data);
+    });
+
+    // 512 KB at 1 MB/s can't take less than half a second, however
+    // loaded the machine is; the bounds leave room for timer slack
+    it("should hold a copy to its bandwidth", function() {
+      var started = Date.now();
+      return nativefs.copy('unthrottled.bin', 'throttled.bin', { engine: 'buffered', bandwidth: 1024 * 1024, iops: 1000, ioPriority: 'idle' }).then(function() {
+        expect(Date.now() - started).to.be.at.least(250);
+        expect(fs.readFileSync('throttled.bin').equals(data)).equal(true);
+      });
+    });
+
+    it("should hold every copy to the global limits", function() {
+      expect(nativefs.throttle({ bandwidth: 1024 * 1024 })).deep.equal({ bandwidth: 1024 * 1024, iops: 0 });
+      var started = Date.now();
+      return nativefs.copy('unthrottled.bin', 'throttled.bin', { engine: 'buffered' }).then(function() {
+        expect(Date.now() - started).to.be.at.least(250);
+      });
+    });
+
+    // at 16 KB/s the copy would take half a minute, so only a cancel
+    // that wakes it ends it inside the timeout
+    it("should cancel a copy waiting on its limit", function() {
+      this.timeout(15000);
+      var controller = nativefs.controller();
+      setTimeout(function() { controller.cancel(); }, 100);
+      return nativefs.copy('unthrottled.bin', 'throttled.bin', { engine: 'buffered', bandwidth: 16 * 1024, controller: controller }).then(function() {
+        throw new Error('copied anyway');
+      }, function(err) {
+        expect(err.code).equal('ECANCELED');
+      });
+    });
+
+    afterEach(function() {
+      nativefs.throttle({ bandwidth: 0, iops: 0 });
+      if (fs.existsSync('throttled.bin')) fs.unlinkSync('throttled.bin');
+    });
+
+    after(function() {
+      fs.unlinkSync('unthrottled.bin');
+    });
+  });
+
+  it("should reuse buffers from the pool", function(done) {
+    var before = nativefs.bufferPool();
+    nativefs.copy('./nativefs.js', 'pooled.js', { engine: 'buffered' }, function(err) {
+      if (err) throw err;
+      var after = nativefs.bufferPool();
+      expect(after.hits + after.misses).above(before.hits + before.misses);
+      expect(after.lent).equal(0);
+      fs.unlinkSync('pooled.js');
+      done();
+    });
+  });
+
   after(function() {
     fs.unlinkSync('moved.js');
   });